@@ -30,16 +30,34 @@ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 #include <stdio.h>
 #include <string.h>
 #include <locale.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
+#include <X11/Xutil.h>
 #include <X11/cursorfont.h>
 #include <X11/Xmu/WinUtil.h>
+#include <X11/extensions/Xrandr.h>
+#include <X11/Xlib-xcb.h>
+#include <xcb/xcb.h>
 #include <glib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define _NET_WM_STATE_REMOVE        0    /* remove/unset property */
 #define _NET_WM_STATE_ADD           1    /* add/set property */
 #define _NET_WM_STATE_TOGGLE        2    /* toggle property  */
 
+#define EXIT_TIMEOUT 124    /* like timeout(1) */
+
 /* help {{{ */
 #define HELP "wmctrl " VERSION "\n" \
 "Usage: wmctrl [OPTION]...\n" \
@@ -47,6 +65,9 @@ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 "  -m                   Show information about the window manager and\n" \
 "                       about the environment.\n" \
 "  -l                   List windows managed by the window manager.\n" \
+"  --summary            Print the number of windows per desktop and per\n" \
+"                       class name (and per state with --show-state), as\n" \
+"                       a table or, with --json, as JSON.\n" \
 "  -d                   List desktops. The current desktop is marked\n" \
 "                       with an asterisk.\n" \
 "  -j                   List current desktop.\n" \
@@ -54,6 +75,26 @@ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 "  -a <WIN>             Activate the window by switching to its desktop and\n" \
 "                       raising it.\n" \
 "  -c <WIN>             Close the window gracefully.\n" \
+"  --close-all <WIN>    Close all matching windows gracefully. The clients\n" \
+"                       of the windows which still exist after the grace\n" \
+"                       period are killed.\n" \
+"  --rules <FILE>       Apply the rules in <FILE> to all windows. The format\n" \
+"                       of the file is described below.\n" \
+"  --rules <FILE> --daemon\n" \
+"                       Keep running and apply the rules to each new window\n" \
+"                       as soon as the window manager manages it. The time\n" \
+"                       from the window's creation to its placement is\n" \
+"                       printed for each matching rule, and a summary per\n" \
+"                       rule on exit.\n" \
+"  --hotkeys <FILE>     Grab the keys listed in <FILE> and run their wmctrl\n" \
+"                       commands until interrupted. The time from each\n" \
+"                       keypress until the requests are sent is printed,\n" \
+"                       and a summary per key on exit. The format of the\n" \
+"                       file is described below.\n" \
+"  --restack <WIN>,<WIN>,...\n" \
+"                       Stack the windows directly on top of each other,\n" \
+"                       the first one topmost. Only the windows which are\n" \
+"                       out of place are restacked.\n" \
 "  -R <WIN>             Move the window to the current desktop and\n" \
 "                       activate it.\n" \
 "  -Y <WIN>             Iconify (minimize) the window.\n" \
@@ -79,6 +120,48 @@ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 "                       The window manager may ignore the request.\n" \
 "  -g <W>,<H>           Change geometry (common size) of all desktops.\n" \
 "                       The window manager may ignore the request.\n" \
+"  --move-desktop <DESK>:<DESK>\n" \
+"                       Move all windows of the first desktop to the second\n" \
+"                       one. Sticky windows stay where they are. With\n" \
+"                       --state only the matching windows are moved.\n" \
+"  --swap-desktops <DESK>:<DESK>\n" \
+"                       Exchange the windows of the two desktops.\n" \
+"  --merge-desktops <DESK>,<DESK>,...:<DESK>\n" \
+"                       Move all windows of the listed desktops to the\n" \
+"                       last one.\n" \
+"  --wait <WIN>         Wait until a window matching <WIN> exists. Its ID\n" \
+"                       and the time to match in milliseconds are printed.\n" \
+"                       An action which otherwise needs -r <WIN> is then\n" \
+"                       applied to this window.\n" \
+"  --icon <WIN> --out <FILE>\n" \
+"                       Save the icon of the window (_NET_WM_ICON) as a PNG\n" \
+"                       or PAM image, depending on the extension of <FILE>.\n" \
+"  --icons-all --out <DIR>\n" \
+"                       Save the icons of all windows as <DIR>/<ID>.png.\n" \
+"  --mru                Keep a focus history (most recently used windows\n" \
+"                       first) for :PREV: and :MRU:<N> until interrupted.\n" \
+"  --metrics-out <FILE> Keep the window metrics in <FILE> in the Prometheus\n" \
+"                       text format until interrupted. The file is\n" \
+"                       replaced every --interval seconds.\n" \
+"  --journal <FILE>     Record the window events in a binary ring buffer\n" \
+"                       journal until interrupted.\n" \
+"  --journal-dump <FILE>\n" \
+"                       Print the records of the journal. They may be\n" \
+"                       limited with --from, --to and -r <WIN>.\n" \
+"  --probe-latency <N>  Measure how fast the window manager reacts to the\n" \
+"                       requests wmctrl sends. Each request is sent <N>\n" \
+"                       times to two test windows and the 50th, 95th and\n" \
+"                       99th percentile of the time until its effect is\n" \
+"                       observed are printed.\n" \
+"  --props <WIN>        Print all the properties of the window as JSON.\n" \
+"  --props-all          Print all the properties of all windows as JSON.\n" \
+"  --stream-geometry <WIN>\n" \
+"                       Read <X>,<Y>,<W>,<H> lines from the standard input\n" \
+"                       and move and resize the window accordingly, at most\n" \
+"                       once per frame (see --fps). A line may start with\n" \
+"                       the hexadecimal ID of another window to move. The\n" \
+"                       numbers of coalesced lines and dropped frames and\n" \
+"                       the achieved frame rate are printed at the end.\n" \
 "  -h                   Print help.\n" \
 "\n" \
 "Options:\n" \
@@ -97,6 +180,43 @@ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 "  -v                   Be verbose. Useful for debugging.\n" \
 "  -w <WA>              Use a workaround. The option may appear multiple\n" \
 "                       times. List of available workarounds is given below.\n" \
+"  --interval <S>       How often --metrics-out is written (default 15).\n" \
+"  --tree               List the windows as a tree: the transients and the\n" \
+"                       members of a window group follow their parent\n" \
+"                       window, with indented titles.\n" \
+"  --with-children      Apply an action to the window and its transient\n" \
+"                       windows (dialogs), and theirs, e.g. -c closes a\n" \
+"                       window with its dialogs. The children come first.\n" \
+"  --json               Print --summary as JSON.\n" \
+"  --fps <N>            Frame rate of --stream-geometry (default 60).\n" \
+"  --show-state         Include the decoded _NET_WM_STATE in the window list.\n" \
+"  --journal-size <N>   Number of records of a new journal (default 65536).\n" \
+"  --from <SEC>, --to <SEC>\n" \
+"                       Time range of --journal-dump in seconds of the\n" \
+"                       monotonic clock. Negative values count back from now.\n" \
+"  --proc               Include the CPU time in seconds and the resident\n" \
+"                       memory in KiB of the process of each window (from\n" \
+"                       /proc) in the window list, and its command line\n" \
+"                       after the title, separated by a tab. Implies -p.\n" \
+"  --show-monitor       Include the RandR monitor of each window (m<N>) in\n" \
+"                       the window list.\n" \
+"  --timeout <MS>       Give up after <MS> milliseconds. This covers the\n" \
+"                       connection to the X server, all requests and waiting\n" \
+"                       for events. Exit status on timeout is 124.\n" \
+"  --displays <:N>,<:M>,...\n" \
+"                       Perform the action on each of the displays at the\n" \
+"                       same time. The output lines are prefixed with the\n" \
+"                       name of the display.\n" \
+"  --displays-glob <GLOB>\n" \
+"                       Like --displays, for all local displays whose name\n" \
+"                       matches <GLOB>, e.g. --displays-glob ':*'.\n" \
+"  --grace <MS>         Grace period of --close-all (default 5000).\n" \
+"  --size <N>           Save the smallest icon at least <N> pixels wide or\n" \
+"                       high, or the largest one if there is none. The\n" \
+"                       default is the largest icon.\n" \
+"  --state <STLIST>     Only list or match windows whose _NET_WM_STATE\n" \
+"                       satisfies <STLIST>. The filter is evaluated before\n" \
+"                       any other property of the window is fetched.\n" \
 "\n" \
 "Arguments:\n" \
 "  <WIN>                This argument specifies the window. By default it's\n" \
@@ -127,6 +247,11 @@ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 "                       may be used to instruct wmctrl to use the currently\n" \
 "                       active window for the action.\n" \
 "\n" \
+"                       The special strings \":PREV:\" and \":MRU:<N>\" use\n" \
+"                       the previously active window, or the <N>th one in\n" \
+"                       the focus history (0 is the active window). They\n" \
+"                       need a running \"wmctrl --mru\".\n" \
+"\n" \
 "  <DESK>               A desktop number. Desktops are counted from zero.\n" \
 "\n" \
 "  <MVARG>              Specifies a change to the position and size\n" \
@@ -145,6 +270,11 @@ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 "                       any of the <X>, <Y>, <W> and <H> properties\n" \
 "                       to left the property unchanged.\n" \
 "\n" \
+"                       <G>,m<N>:<X>,<Y>,<W>,<H> makes <X>,<Y> relative to\n" \
+"                       the RandR monitor <N> (see --show-monitor). Any of\n" \
+"                       the values may be a percentage of the monitor's\n" \
+"                       (or the screen's) size, e.g. 0,m1:0,0,50%,100%.\n" \
+"\n" \
 "  <STARG>              Specifies a change to the state of the window\n" \
 "                       by the means of _NET_WM_STATE request.\n" \
 "                       This option allows two properties to be changed\n" \
@@ -163,6 +293,11 @@ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 "                           shaded, skip_taskbar, skip_pager, hidden,\n" \
 "                           fullscreen, above, below\n" \
 "\n" \
+"  <STLIST>             A comma separated list of the state properties listed\n" \
+"                       above (or \"undecorated\"). A property prefixed\n" \
+"                       with \"!\" must not be set, the others must be set.\n" \
+"                       Example: --state hidden,!sticky\n" \
+"\n" \
 "Workarounds:\n" \
 "\n" \
 "  DESKTOP_TITLES_INVALID_UTF8      Print non-ASCII desktop titles correctly\n" \
@@ -170,21 +305,95 @@ Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
 "\n" \
 "The format of the window list:\n" \
 "\n" \
-"  <window ID> <desktop ID> <client machine> <window title>\n" \
+"  <window ID> <desktop ID> [<state>] <client machine> <window title>\n" \
 "\n" \
 "The format of the desktop list:\n" \
 "\n" \
 "  <desktop ID> [-*] <geometry> <viewport> <workarea> <title>\n" \
 "\n" \
+"The format of the rules file (one rule per line, # starts a comment):\n" \
+"\n" \
+"  (title|class)[~] <pattern> -> <action> [<argument>]\n" \
+"\n" \
+"  The pattern is a case insensitive substring of the window title or\n" \
+"  class, or a regular expression if the field name is followed by ~.\n" \
+"  The action is one of the action letters taking <WIN>, and the\n" \
+"  argument is what the action would take on the command line, e.g.\n" \
+"\n" \
+"  class~ ^xterm\\. -> e 0,0,0,800,600\n" \
+"  title Mozilla Firefox -> t 1\n" \
+"\n" \
+"The format of the hotkeys file (one key per line, # starts a comment):\n" \
+"\n" \
+"  [<MODIFIER>+]...<KEY> -> [wmctrl] <OPTIONS>\n" \
+"\n" \
+"  The modifiers are Shift, Control (Ctrl), Alt, Super and Mod1 to Mod5,\n" \
+"  the key is a keysym name. The options are those of one wmctrl command\n" \
+"  with -s, -k, -o, -n, -g, or an action on <WIN>, and -i, -x and -F, e.g.\n" \
+"\n" \
+"  Super+1 -> -s 0\n" \
+"  Super+Shift+Left -> -r :ACTIVE: -e 0,0,0,960,1080\n" \
+"\n" \
 "\n" \
 "Author, current maintainer: Tomas Styblo <tripie@cpan.org>\n" \
 "Released under the GNU General Public License.\n" \
 "Copyright (C) 2003\n"
 /* }}} */
 
+#define SHORT_OPTIONS "FGVvhSlupidjmxa:r:s:c:t:w:k:o:n:g:e:y:b:z:E:N:I:T:R:Y:"
+
 #define MAX_PROPERTY_VALUE_LEN 4096
 #define SELECT_WINDOW_MAGIC ":SELECT:"
 #define ACTIVE_WINDOW_MAGIC ":ACTIVE:"
+#define PREV_WINDOW_MAGIC ":PREV:"
+#define MRU_WINDOW_MAGIC ":MRU:"
+
+/* codes of the options which are only available in the long form,
+ * kept out of the range of the getopt() characters */
+#define OPT_STATE       256
+#define OPT_SHOW_STATE  257
+#define OPT_WAIT        258
+#define OPT_TIMEOUT     259
+#define OPT_CLOSE_ALL   260
+#define OPT_GRACE       261
+#define OPT_RULES       262
+#define OPT_DAEMON      263
+#define OPT_ICON        264
+#define OPT_ICONS_ALL   265
+#define OPT_SIZE        266
+#define OPT_OUT         267
+#define OPT_DISPLAYS    268
+#define OPT_DISPLAYS_GLOB 269
+#define OPT_SHOW_MONITOR 270
+#define OPT_JOURNAL     271
+#define OPT_JOURNAL_SIZE 272
+#define OPT_JOURNAL_DUMP 273
+#define OPT_FROM        274
+#define OPT_TO          275
+#define OPT_PROBE_LATENCY 276
+#define OPT_MRU         277
+#define OPT_RESTACK     278
+#define OPT_PROPS       279
+#define OPT_PROPS_ALL   280
+#define OPT_PROC        281
+#define OPT_SUMMARY     282
+#define OPT_JSON        283
+#define OPT_METRICS_OUT 284
+#define OPT_INTERVAL    285
+#define OPT_TREE        286
+#define OPT_WITH_CHILDREN 287
+#define OPT_MOVE_DESKTOP 288
+#define OPT_SWAP_DESKTOPS 289
+#define OPT_MERGE_DESKTOPS 290
+#define OPT_STREAM_GEOMETRY 291
+#define OPT_FPS         292
+#define OPT_HOTKEYS     293
+
+#define DEFAULT_CLOSE_GRACE 5000    /* ms */
+#define STICKY_DESKTOP 0xFFFFFFFFUL  /* _NET_WM_DESKTOP of sticky windows */
+
+#define X11_SOCKET_DIR "/tmp/.X11-unix"
+#define MAX_DISPLAY_JOBS 16     /* displays queried at the same time */
 
 #define p_verbose(...) if (options.verbose) { \
     fprintf(stderr, __VA_ARGS__); \
@@ -198,6 +407,8 @@ static int client_msg(Display *disp, Window win, char *msg,
         unsigned long data2, unsigned long data3,
         unsigned long data4);
 static int list_windows (Display *disp);
+static gboolean host_names_match (const gchar *a, const gchar *b);
+static gboolean is_local_machine (const gchar *client_machine);
 static int list_current_desktop (Display *disp);
 static int list_desktops (Display *disp);
 static int showing_desktop (Display *disp);
@@ -205,29 +416,100 @@ static int change_viewport (Display *disp);
 static int change_geometry (Display *disp);
 static int change_number_of_desktops (Display *disp);
 static int switch_desktop (Display *disp);
+static int relocate_desktops (Display *disp, int mode);
 static int wm_info (Display *disp);
 static gchar *get_output_str (gchar *str, gboolean is_utf8);
-static int action_window (Display *disp, Window win, char mode);
-static int action_window_pid (Display *disp, char mode);
-static int action_window_str (Display *disp, char mode);
+static gchar *take_output_str (gchar *str, gboolean is_utf8);
+static gchar *locale_to_utf8 (const gchar *str);
+static int action_window (Display *disp, Window win, int mode);
+static int run_window_action (Display *disp, Window win, int mode);
+static int action_window_pid (Display *disp, int mode);
+static int action_window_str (Display *disp, int mode);
 static int activate_window (Display *disp, Window win,
         gboolean switch_desktop);
 static int close_window (Display *disp, Window win);
+static int close_all_windows (Display *disp);
+static int apply_rules (Display *disp);
+static int watch_hotkeys (Display *disp);
+static int save_icon (Display *disp, Window win, const char *file);
+static int save_all_icons (Display *disp);
 static int longest_str (gchar **strv);
 static int window_to_desktop (Display *disp, Window win, int desktop);
 static void window_set_title (Display *disp, Window win, char *str, char mode);
 static gchar *get_window_title (Display *disp, Window win);
 static gchar *get_window_class (Display *disp, Window win);
+static gchar *title_from_names (gchar *wm_name, gchar *net_wm_name);
+static gchar *class_from_property (gchar *wm_class, unsigned long size);
 static gchar *get_property (Display *disp, Window win,
         Atom xa_prop_type, gchar *prop_name, unsigned long *size);
+static xcb_get_property_cookie_t get_property_request (Display *disp,
+        Window win, Atom xa_prop_type, gchar *prop_name);
+static gchar *get_property_reply (Display *disp,
+        xcb_get_property_cookie_t cookie, Atom xa_prop_type,
+        unsigned long *size, gboolean *vanished);
+static gchar *property_reply_data (xcb_get_property_reply_t *reply,
+        unsigned long *size);
 static void init_charset(void);
 static int window_move_resize (Display *disp, Window win, char *arg);
+static int move_resize_window (Display *disp, Window win, char *arg,
+        gboolean netwm);
+static int stream_geometry (Display *disp, Window win);
 static int window_state (Display *disp, Window win, char *arg);
 static Window Select_Window(Display *dpy);
 static Window get_active_window(Display *dpy);
+static int parse_long_option (int *argc, char **argv, char **arg);
+static unsigned long wm_state_bit (const char *name);
+static int parse_state_filter (const char *arg);
+static gboolean get_window_state (Display *disp, Window win,
+        unsigned long *state);
+static gboolean state_passes_filter (unsigned long state);
+static gboolean window_state_matches (Display *disp, Window win);
+static int filter_windows_by_state (Display *disp, Window *wins, int n);
+static gchar *wm_state_str (unsigned long state);
+static gboolean window_matches_str (Display *disp, Window win,
+        const char *str);
+static gchar **get_match_strings (Display *disp, Window *wins, int n);
+static int wait_for_window (Display *disp, Window *win);
+static gboolean next_event (Display *disp, XEvent *event, gint64 deadline);
+static gboolean next_window_event (Display *disp, Window win, long mask,
+        XEvent *event);
+static void init_timeout (void);
+static void init_error_handler (void);
+static void init_interrupt_handler (void);
+static gboolean window_vanished (Window win, unsigned long serial);
+static int run_action (const char *display_name, int action);
+static int run_on_displays (int action);
+static gboolean parse_journal_time (const char *arg, gint64 *time);
+static int record_journal (Display *disp);
+static int dump_journal (void);
+static int probe_latency (Display *disp);
+static int track_mru (Display *disp);
+static int restack_windows (Display *disp);
+static int windows_props_json (Display *disp, const Window *wins, int n,
+        GString *out);
+static int print_window_props (Display *disp, Window win);
+static int print_all_props (Display *disp);
+static int print_summary (Display *disp);
+static int export_metrics (Display *disp);
 
 /*}}}*/
 
+/* a monitor from the RandR monitor table */
+typedef struct {
+    gchar *name;
+    int x, y;
+    int width, height;
+    gboolean primary;
+} monitor_info;
+
+/* a <WIN> string prepared for matching against many titles */
+typedef struct {
+    gchar *utf8;
+    gchar *casefold;
+    gsize casefold_len;
+    gboolean ascii;     /* casefold is plain ASCII lowercase */
+} match_pattern;
+
 static struct {
     int verbose;
     int force_utf8;
@@ -239,20 +521,123 @@ static struct {
 	int match_by_cls;
     int full_window_title_match;
     int wa_desktop_titles_invalid_utf8;
+    int show_state;
+    int show_monitor;
+    int show_proc;
+    int json;
+    int tree;
+    int with_children;
+    int daemon;
+    int filter_state;
+    unsigned long state_required;
+    unsigned long state_rejected;
+    long timeout;
+    long grace;
+    long icon_size;
+    unsigned long journal_size;
+    int probe_count;
+    long interval;
+    long fps;
+    gint64 journal_from;
+    gint64 journal_to;
+    char *param_out;
+    char *param_wait;
+    char *param_rules;
+    char *param_hotkeys;
+    char *param_journal;
+    char *param_metrics;
+    char *param_displays;
+    char *param_displays_glob;
     char *param_window;
     char *param;
 } options;
 
 static gboolean envir_utf8;
 
+/* charset of the locale as reported by glib; the converters
+ * between it and UTF-8 are opened once and reused */
+static const gchar *locale_charset;
+static gboolean locale_is_utf8;
+static GIConv locale_to_utf8_conv = (GIConv)-1;
+static GIConv locale_from_utf8_conv = (GIConv)-1;
+
+/* the --timeout deadline in monotonic microseconds, -1 means none */
+static gint64 timeout_deadline = -1;
+static gboolean timed_out = FALSE;
+
+/* set by SIGINT and SIGTERM in the long running modes */
+static volatile sig_atomic_t interrupted = 0;
+
+/* windows which produced a BadWindow or BadDrawable error, mapped to
+ * the serial number of the failed request */
+static GHashTable *vanished_windows = NULL;
+static XErrorHandler default_error_handler = NULL;
+
+/* BadAtom is expected while the names of arbitrary atoms are fetched */
+static gboolean ignore_bad_atoms = FALSE;
+
+/* BadAccess is expected while keys are grabbed, it's only recorded */
+static gboolean ignore_bad_access = FALSE;
+static gboolean bad_access = FALSE;
+
+/* BadValue is expected from XKillClient() for a client which is gone,
+ * it's recorded like a vanished window */
+static gboolean ignore_bad_value = FALSE;
+
+static const struct {
+    const char *name;
+    int has_arg;
+    int code;
+} long_options[] = {
+    {"state",       1, OPT_STATE},
+    {"show-state",  0, OPT_SHOW_STATE},
+    {"wait",        1, OPT_WAIT},
+    {"timeout",     1, OPT_TIMEOUT},
+    {"close-all",   1, OPT_CLOSE_ALL},
+    {"grace",       1, OPT_GRACE},
+    {"rules",       1, OPT_RULES},
+    {"daemon",      0, OPT_DAEMON},
+    {"icon",        1, OPT_ICON},
+    {"icons-all",   0, OPT_ICONS_ALL},
+    {"size",        1, OPT_SIZE},
+    {"out",         1, OPT_OUT},
+    {"displays",    1, OPT_DISPLAYS},
+    {"displays-glob", 1, OPT_DISPLAYS_GLOB},
+    {"show-monitor", 0, OPT_SHOW_MONITOR},
+    {"journal",     1, OPT_JOURNAL},
+    {"journal-size", 1, OPT_JOURNAL_SIZE},
+    {"journal-dump", 1, OPT_JOURNAL_DUMP},
+    {"from",        1, OPT_FROM},
+    {"to",          1, OPT_TO},
+    {"probe-latency", 1, OPT_PROBE_LATENCY},
+    {"mru",         0, OPT_MRU},
+    {"restack",     1, OPT_RESTACK},
+    {"props",       1, OPT_PROPS},
+    {"props-all",   0, OPT_PROPS_ALL},
+    {"proc",        0, OPT_PROC},
+    {"summary",     0, OPT_SUMMARY},
+    {"json",        0, OPT_JSON},
+    {"metrics-out", 1, OPT_METRICS_OUT},
+    {"interval",    1, OPT_INTERVAL},
+    {"tree",        0, OPT_TREE},
+    {"with-children", 0, OPT_WITH_CHILDREN},
+    {"move-desktop", 1, OPT_MOVE_DESKTOP},
+    {"swap-desktops", 1, OPT_SWAP_DESKTOPS},
+    {"merge-desktops", 1, OPT_MERGE_DESKTOPS},
+    {"stream-geometry", 1, OPT_STREAM_GEOMETRY},
+    {"fps",         1, OPT_FPS},
+    {"hotkeys",     1, OPT_HOTKEYS},
+    {NULL, 0, 0}
+};
+
 int main (int argc, char **argv) { /* {{{ */
     int opt;
+    char *longarg;
     int action = 0;
-    int ret = EXIT_SUCCESS;
     int missing_option = 1;
-    Display *disp;
 
     memset(&options, 0, sizeof(options)); /* just for sure */
+    options.grace = DEFAULT_CLOSE_GRACE;
 
     /* necessary to make g_get_charset() and g_locale_*() work */
     setlocale(LC_ALL, "");
@@ -270,7 +655,151 @@ int main (int argc, char **argv) { /* {{{ */
         }
     }
 
-    while ((opt = getopt(argc, argv, "FGVvhSlupidjmxa:r:s:c:t:w:k:o:n:g:e:y:b:z:E:N:I:T:R:Y:")) != -1) {
+    /* the few long options are stripped from argv before getopt() runs */
+    while ((opt = parse_long_option(&argc, argv, &longarg)) != 0) {
+        missing_option = 0;
+        switch (opt) {
+            case OPT_STATE:
+                if (parse_state_filter(longarg) != EXIT_SUCCESS) {
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_SHOW_STATE:
+                options.show_state = 1;
+                break;
+            case OPT_SHOW_MONITOR:
+                options.show_monitor = 1;
+                break;
+            case OPT_METRICS_OUT:
+                options.param_metrics = longarg;
+                action = opt;
+                break;
+            case OPT_INTERVAL:
+                if (sscanf(longarg, "%ld", &options.interval) != 1 ||
+                        options.interval <= 0) {
+                    fputs("The --interval option expects a positive integer.\n", stderr);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_FPS:
+                if (sscanf(longarg, "%ld", &options.fps) != 1 ||
+                        options.fps <= 0 || options.fps > 1000) {
+                    fputs("The --fps option expects an integer from 1 to 1000.\n", stderr);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_JSON:
+                options.json = 1;
+                break;
+            case OPT_TREE:
+                options.tree = 1;
+                break;
+            case OPT_WITH_CHILDREN:
+                options.with_children = 1;
+                break;
+            case OPT_PROC:
+                options.show_proc = 1;
+                options.show_pid = 1;
+                break;
+            case OPT_WAIT:
+                options.param_wait = longarg;
+                break;
+            case OPT_CLOSE_ALL: case OPT_RESTACK:
+                options.param_window = longarg;
+                action = opt;
+                break;
+            case OPT_MOVE_DESKTOP: case OPT_SWAP_DESKTOPS:
+            case OPT_MERGE_DESKTOPS:
+                options.param = longarg;
+                action = opt;
+                break;
+            case OPT_RULES:
+                options.param_rules = longarg;
+                action = opt;
+                break;
+            case OPT_HOTKEYS:
+                options.param_hotkeys = longarg;
+                action = opt;
+                break;
+            case OPT_DAEMON:
+                options.daemon = 1;
+                break;
+            case OPT_ICON: case OPT_PROPS: case OPT_STREAM_GEOMETRY:
+                options.param_window = longarg;
+                action = opt;
+                break;
+            case OPT_ICONS_ALL: case OPT_MRU: case OPT_PROPS_ALL:
+            case OPT_SUMMARY:
+                action = opt;
+                break;
+            case OPT_SIZE:
+                if (sscanf(longarg, "%ld", &options.icon_size) != 1 ||
+                        options.icon_size <= 0) {
+                    fputs("The --size option expects a positive integer.\n", stderr);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_OUT:
+                options.param_out = longarg;
+                break;
+            case OPT_JOURNAL: case OPT_JOURNAL_DUMP:
+                options.param_journal = longarg;
+                action = opt;
+                break;
+            case OPT_JOURNAL_SIZE:
+                if (sscanf(longarg, "%lu", &options.journal_size) != 1 ||
+                        options.journal_size == 0 ||
+                        options.journal_size > G_MAXINT32) {
+                    fputs("The --journal-size option expects a positive integer.\n", stderr);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_FROM:
+                if (! parse_journal_time(longarg, &options.journal_from)) {
+                    fputs("The --from option expects a number of seconds.\n", stderr);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_TO:
+                if (! parse_journal_time(longarg, &options.journal_to)) {
+                    fputs("The --to option expects a number of seconds.\n", stderr);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_PROBE_LATENCY:
+                if (sscanf(longarg, "%d", &options.probe_count) != 1 ||
+                        options.probe_count <= 0) {
+                    fputs("The --probe-latency option expects a positive integer.\n", stderr);
+                    return EXIT_FAILURE;
+                }
+                action = opt;
+                break;
+            case OPT_DISPLAYS:
+                options.param_displays = longarg;
+                break;
+            case OPT_DISPLAYS_GLOB:
+                options.param_displays_glob = longarg;
+                break;
+            case OPT_GRACE:
+                if (sscanf(longarg, "%ld", &options.grace) != 1 ||
+                        options.grace < 0) {
+                    fputs("The --grace option expects a non-negative integer.\n", stderr);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case OPT_TIMEOUT:
+                if (sscanf(longarg, "%ld", &options.timeout) != 1 ||
+                        options.timeout <= 0) {
+                    fputs("The --timeout option expects a positive integer.\n", stderr);
+                    return EXIT_FAILURE;
+                }
+                break;
+            default:
+                return EXIT_FAILURE;
+        }
+    }
+
+    while ((opt = getopt(argc, argv, SHORT_OPTIONS)) != -1) {
         missing_option = 0;
         switch (opt) {
             case 'F':
@@ -340,11 +869,44 @@ int main (int argc, char **argv) { /* {{{ */
 
     init_charset();
 
-    if (! (disp = XOpenDisplay(NULL))) {
-        fputs("Cannot open display.\n", stderr);
+    /* the journal is read without connecting to the X server */
+    if (action == OPT_JOURNAL_DUMP) {
+        return dump_journal();
+    }
+    if (options.param_displays || options.param_displays_glob) {
+        return run_on_displays(action);
+    }
+    return run_action(NULL, action);
+}
+/* }}} */
+
+static int run_action (const char *display_name, int action) {/*{{{*/
+    /* connect to the display (NULL means $DISPLAY) and perform the action */
+    Display *disp;
+    Window waited = 0;
+    int ret = EXIT_SUCCESS;
+
+    init_timeout();
+
+    if (! (disp = XOpenDisplay(display_name))) {
+        if (display_name) {
+            fprintf(stderr, "Cannot open display %s.\n", display_name);
+        }
+        else {
+            fputs("Cannot open display.\n", stderr);
+        }
         return EXIT_FAILURE;
     }
 
+    init_error_handler();
+
+    if (options.param_wait) {
+        if ((ret = wait_for_window(disp, &waited)) != EXIT_SUCCESS) {
+            XCloseDisplay(disp);
+            return timed_out ? EXIT_TIMEOUT : ret;
+        }
+    }
+
     switch (action) {
         case 'V':
             puts(VERSION);
@@ -370,6 +932,10 @@ int main (int argc, char **argv) { /* {{{ */
         case 'a': case 'c': case 'R': case 'z': case 'E':
         case 't': case 'e': case 'b': case 'N': case 'I': case 'T': case 'y':
         case 'Y':
+            if (! options.param_window && waited) {
+                ret = action_window(disp, waited, action);
+                break;
+            }
             if (! options.param_window) {
                 fputs("No window was specified.\n", stderr);
                 return EXIT_FAILURE;
@@ -381,6 +947,68 @@ int main (int argc, char **argv) { /* {{{ */
                 ret = action_window_str(disp, action);
             }
             break;
+        case OPT_CLOSE_ALL:
+            ret = close_all_windows(disp);
+            break;
+        case OPT_RULES:
+            ret = apply_rules(disp);
+            break;
+        case OPT_HOTKEYS:
+            ret = watch_hotkeys(disp);
+            break;
+        case OPT_JOURNAL:
+            ret = record_journal(disp);
+            break;
+        case OPT_PROBE_LATENCY:
+            ret = probe_latency(disp);
+            break;
+        case OPT_MRU:
+            ret = track_mru(disp);
+            break;
+        case OPT_RESTACK:
+            ret = restack_windows(disp);
+            break;
+        case OPT_PROPS: case OPT_STREAM_GEOMETRY:
+            if (options.match_by_id) {
+                ret = action_window_pid(disp, action);
+            }
+            else {
+                ret = action_window_str(disp, action);
+            }
+            break;
+        case OPT_PROPS_ALL:
+            ret = print_all_props(disp);
+            break;
+        case OPT_SUMMARY:
+            ret = print_summary(disp);
+            break;
+        case OPT_METRICS_OUT:
+            ret = export_metrics(disp);
+            break;
+        case OPT_MOVE_DESKTOP: case OPT_SWAP_DESKTOPS:
+        case OPT_MERGE_DESKTOPS:
+            ret = relocate_desktops(disp, action);
+            break;
+        case OPT_ICON: case OPT_ICONS_ALL:
+            if (! options.param_out) {
+                fputs("No output file was specified (--out).\n", stderr);
+                return EXIT_FAILURE;
+            }
+            if (action == OPT_ICON && ! g_str_has_suffix(options.param_out, ".png") &&
+                    ! g_str_has_suffix(options.param_out, ".pam")) {
+                fputs("The --out file has to end with .png or .pam.\n", stderr);
+                return EXIT_FAILURE;
+            }
+            if (action == OPT_ICONS_ALL) {
+                ret = save_all_icons(disp);
+            }
+            else if (options.match_by_id) {
+                ret = action_window_pid(disp, action);
+            }
+            else {
+                ret = action_window_str(disp, action);
+            }
+            break;
         case 'k':
             ret = showing_desktop(disp);
             break;
@@ -396,17 +1024,331 @@ int main (int argc, char **argv) { /* {{{ */
     }
 
     XCloseDisplay(disp);
+    return timed_out ? EXIT_TIMEOUT : ret;
+}/*}}}*/
+
+typedef struct {
+    gchar *name;
+    pid_t pid;
+    int fd;             /* read end of the child's stdout, -1 when done */
+    GString *pending;   /* the unfinished last line */
+    int status;
+} display_job;
+
+static gint compare_display_names (gconstpointer a, gconstpointer b) {/*{{{*/
+    /* ":2" before ":10" */
+    const gchar *x = *(const gchar **)a;
+    const gchar *y = *(const gchar **)b;
+    long nx = strtol(x + 1, NULL, 10);
+    long ny = strtol(y + 1, NULL, 10);
+
+    return nx < ny ? -1 : nx > ny;
+}/*}}}*/
+
+static GPtrArray *get_display_names (void) {/*{{{*/
+    /* the names given by --displays followed by the local displays
+     * whose sockets match --displays-glob */
+    GPtrArray *names = g_ptr_array_new_with_free_func(g_free);
+    gchar **list;
+    GDir *dir;
+    const gchar *entry;
+    guint first_glob;
+    int i;
+
+    if (options.param_displays) {
+        list = g_strsplit(options.param_displays, ",", 0);
+        for (i = 0; list[i]; i++) {
+            g_strstrip(list[i]);
+            if (*list[i]) {
+                g_ptr_array_add(names, g_strdup(list[i]));
+            }
+        }
+        g_strfreev(list);
+    }
+
+    first_glob = names->len;
+    if (options.param_displays_glob &&
+            (dir = g_dir_open(X11_SOCKET_DIR, 0, NULL))) {
+        while ((entry = g_dir_read_name(dir))) {
+            gchar *name;
+
+            if (entry[0] != 'X' || ! entry[1] ||
+                    strspn(entry + 1, "0123456789") != strlen(entry + 1)) {
+                continue;
+            }
+            name = g_strconcat(":", entry + 1, NULL);
+            if (g_pattern_match_simple(options.param_displays_glob, name)) {
+                g_ptr_array_add(names, name);
+            }
+            else {
+                g_free(name);
+            }
+        }
+        g_dir_close(dir);
+        qsort(names->pdata + first_glob, names->len - first_glob,
+                sizeof(gpointer), compare_display_names);
+    }
+
+    return names;
+}/*}}}*/
+
+static gboolean start_display_job (display_job *jobs, int n, int job,
+        int action) {/*{{{*/
+    /* fork a child which performs the action on one display with its
+     * stdout connected to a pipe */
+    int pfd[2];
+    int i;
+
+    if (pipe(pfd) != 0) {
+        fprintf(stderr, "%s: cannot create a pipe: %s\n",
+                jobs[job].name, strerror(errno));
+        return FALSE;
+    }
+
+    /* don't let the child inherit and flush our buffered output */
+    fflush(stdout);
+    fflush(stderr);
+
+    switch (jobs[job].pid = fork()) {
+        case -1:
+            fprintf(stderr, "%s: cannot fork: %s\n",
+                    jobs[job].name, strerror(errno));
+            close(pfd[0]);
+            close(pfd[1]);
+            return FALSE;
+        case 0:
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            for (i = 0; i < n; i++) {
+                if (jobs[i].fd >= 0) {
+                    close(jobs[i].fd);
+                }
+            }
+            close(pfd[0]);
+            dup2(pfd[1], STDOUT_FILENO);
+            close(pfd[1]);
+            i = run_action(jobs[job].name, action);
+            fflush(stdout);
+            _exit(i);
+    }
+
+    close(pfd[1]);
+    jobs[job].fd = pfd[0];
+    return TRUE;
+}/*}}}*/
+
+static void print_display_lines (display_job *job, gboolean eof) {/*{{{*/
+    /* print the complete lines received from the child,
+     * each prefixed with the name of the display */
+    gchar *line = job->pending->str;
+    gchar *nl;
+
+    while ((nl = strchr(line, '\n'))) {
+        printf("%s %.*s\n", job->name, (int)(nl - line), line);
+        line = nl + 1;
+    }
+    if (eof && *line) {
+        printf("%s %s\n", job->name, line);
+        line += strlen(line);
+    }
+    g_string_erase(job->pending, 0, line - job->pending->str);
+}/*}}}*/
+
+static int run_on_displays (int action) {/*{{{*/
+    /* Perform the action on all the displays given by --displays and
+     * --displays-glob, up to MAX_DISPLAY_JOBS of them at the same time.
+     * Each display is handled by its own process with its own connection,
+     * so a slow server delays only its own part of the output. */
+    GPtrArray *names = get_display_names();
+    display_job *jobs;
+    struct pollfd pfds[MAX_DISPLAY_JOBS];
+    int slot_job[MAX_DISPLAY_JOBS];
+    int n = names->len;
+    int next = 0, running = 0, done = 0;
+    gboolean forwarded = FALSE;
+    int ret = EXIT_SUCCESS;
+    char buf[4096];
+    ssize_t len;
+    int i, nfds;
+
+    if (n == 0) {
+        fputs("No display was specified or matched.\n", stderr);
+        g_ptr_array_free(names, TRUE);
+        return EXIT_FAILURE;
+    }
+
+    jobs = g_new0(display_job, n);
+    for (i = 0; i < n; i++) {
+        jobs[i].name = g_ptr_array_index(names, i);
+        jobs[i].fd = -1;
+        jobs[i].pending = g_string_new("");
+    }
+
+    /* the children are stopped with SIGTERM, so that a --daemon
+     * can still print its summary through us */
+    init_interrupt_handler();
+
+    while (done < n) {
+        while (! interrupted && running < MAX_DISPLAY_JOBS && next < n) {
+            if (start_display_job(jobs, n, next, action)) {
+                p_verbose("%s: started process %ld\n",
+                        jobs[next].name, (long)jobs[next].pid);
+                running++;
+            }
+            else {
+                jobs[next].status = EXIT_FAILURE;
+                done++;
+            }
+            next++;
+        }
+        if (interrupted && next < n) {
+            /* the displays which haven't been started yet */
+            for (; next < n; next++) {
+                jobs[next].status = EXIT_FAILURE;
+                done++;
+            }
+        }
+        if (interrupted && ! forwarded) {
+            for (i = 0; i < n; i++) {
+                if (jobs[i].fd >= 0) {
+                    kill(jobs[i].pid, SIGTERM);
+                }
+            }
+            forwarded = TRUE;
+        }
+        if (running == 0) {
+            break;
+        }
+
+        for (i = 0, nfds = 0; i < n; i++) {
+            if (jobs[i].fd >= 0) {
+                pfds[nfds].fd = jobs[i].fd;
+                pfds[nfds].events = POLLIN;
+                slot_job[nfds++] = i;
+            }
+        }
+        if (poll(pfds, nfds, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("poll");
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        for (i = 0; i < nfds; i++) {
+            display_job *job = &jobs[slot_job[i]];
+            int status;
+
+            if (! pfds[i].revents) {
+                continue;
+            }
+            if ((len = read(job->fd, buf, sizeof(buf))) > 0) {
+                g_string_append_len(job->pending, buf, len);
+                print_display_lines(job, FALSE);
+                continue;
+            }
+            if (len < 0 && errno == EINTR) {
+                continue;
+            }
+
+            /* EOF: the child has finished */
+            print_display_lines(job, TRUE);
+            close(job->fd);
+            job->fd = -1;
+            while (waitpid(job->pid, &status, 0) < 0 && errno == EINTR);
+            job->status = WIFEXITED(status) ? WEXITSTATUS(status) : EXIT_FAILURE;
+            p_verbose("%s: exit status %d\n", job->name, job->status);
+            running--;
+            done++;
+        }
+        fflush(stdout);
+    }
+
+    /* 124 if any display timed out, otherwise failure if any failed */
+    for (i = 0; i < n; i++) {
+        if (jobs[i].status == EXIT_TIMEOUT) {
+            ret = EXIT_TIMEOUT;
+        }
+        else if (jobs[i].status != EXIT_SUCCESS && ret != EXIT_TIMEOUT) {
+            ret = EXIT_FAILURE;
+        }
+        g_string_free(jobs[i].pending, TRUE);
+    }
+    g_free(jobs);
+    g_ptr_array_free(names, TRUE);
     return ret;
-}
-/* }}} */
+}/*}}}*/
+
+static gboolean short_option_takes_arg (const char *arg) {/*{{{*/
+    /* does the last option character in a "-abc" group expect
+     * the following element of argv as its argument? */
+    const char *p;
+    size_t len;
+
+    if (arg[0] != '-' || arg[1] == '-' || (len = strlen(arg)) < 2) {
+        return FALSE;
+    }
+    p = strchr(SHORT_OPTIONS, arg[len - 1]);
+    return p && p[1] == ':';
+}/*}}}*/
+
+static int parse_long_option (int *argc, char **argv, char **arg) {/*{{{*/
+    /* Remove the first "--name [value]" from argv and return its code.
+     * Returns 0 if there are no long options left and -1 on error.
+     * getopt_long() isn't used for portability reasons. */
+    int i, j, k, consumed;
+
+    for (i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "--") == 0) {
+            break;
+        }
+        if (short_option_takes_arg(argv[i])) {
+            i++;
+            continue;
+        }
+        if (strncmp(argv[i], "--", 2) != 0) {
+            continue;
+        }
+
+        for (j = 0; long_options[j].name; j++) {
+            if (strcmp(argv[i] + 2, long_options[j].name) == 0) {
+                break;
+            }
+        }
+        if (! long_options[j].name) {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return -1;
+        }
+
+        *arg = NULL;
+        consumed = 1;
+        if (long_options[j].has_arg) {
+            if (i + 1 >= *argc) {
+                fprintf(stderr, "Option %s requires an argument.\n", argv[i]);
+                return -1;
+            }
+            *arg = argv[i + 1];
+            consumed = 2;
+        }
+
+        /* argv[*argc] is NULL and gets moved as well */
+        for (k = i; k + consumed <= *argc; k++) {
+            argv[k] = argv[k + consumed];
+        }
+        *argc -= consumed;
+        return long_options[j].code;
+    }
+
+    return 0;
+}/*}}}*/
 
 static void init_charset (void) {/*{{{*/
-  const gchar *charset; /* unused */
   gchar *lang = getenv("LANG") ? g_ascii_strup(getenv("LANG"), -1) : NULL;
   gchar *lc_ctype = getenv("LC_CTYPE") ? g_ascii_strup(getenv("LC_CTYPE"), -1) : NULL;
 
   /* this glib function doesn't work on my system ... */
-  envir_utf8 = g_get_charset(&charset);
+  envir_utf8 = locale_is_utf8 = g_get_charset(&locale_charset);
 
   /* ... therefore we will examine the environment variables */
   if (lc_ctype && (strstr(lc_ctype, "UTF8") || strstr(lc_ctype, "UTF-8"))) {
@@ -425,67 +1367,278 @@ static void init_charset (void) {/*{{{*/
   p_verbose("envir_utf8: %d\n", envir_utf8);
 }/*}}}*/
 
-static int client_msg(Display *disp, Window win, char *msg, /* {{{ */
-    unsigned long data0, unsigned long data1,
-    unsigned long data2, unsigned long data3,
-    unsigned long data4) {
-  XEvent event;
-  long mask = SubstructureRedirectMask | SubstructureNotifyMask;
+static void timeout_handler (int sig) {/*{{{*/
+    /* a synchronous Xlib call didn't return in time. Only async-signal-safe
+     * functions may be used here. */
+    static const char msg[] = "Timeout: no response from the X server.\n";
+    if (write(STDERR_FILENO, msg, sizeof(msg) - 1) < 0) {
+        /* nothing to do */
+    }
+    _exit(EXIT_TIMEOUT);
+}/*}}}*/
 
-  event.xclient.type = ClientMessage;
-  event.xclient.serial = 0;
-  event.xclient.send_event = True;
-  event.xclient.message_type = XInternAtom(disp, msg, False);
-  event.xclient.window = win;
-  event.xclient.format = 32;
-  event.xclient.data.l[0] = data0;
-  event.xclient.data.l[1] = data1;
-  event.xclient.data.l[2] = data2;
-  event.xclient.data.l[3] = data3;
-  event.xclient.data.l[4] = data4;
+static void init_timeout (void) {/*{{{*/
+    /* Event waits check timeout_deadline themselves. Requests which wait
+     * for a reply (XOpenDisplay, XGetWindowProperty, XGrabPointer ...)
+     * can't be interrupted in Xlib, so they are bounded by a watchdog
+     * timer firing at the same deadline. */
+    struct itimerval timer;
 
-  if (XSendEvent(disp, DefaultRootWindow(disp), False, mask, &event)) {
-    return EXIT_SUCCESS;
-  }
-  else {
+    if (options.timeout <= 0) {
+        return;
+    }
+
+    timeout_deadline = g_get_monotonic_time() + options.timeout * 1000;
+
+    memset(&timer, 0, sizeof(timer));
+    timer.it_value.tv_sec = options.timeout / 1000;
+    timer.it_value.tv_usec = (options.timeout % 1000) * 1000;
+    signal(SIGALRM, timeout_handler);
+    setitimer(ITIMER_REAL, &timer, NULL);
+}/*}}}*/
+
+static int error_handler (Display *disp, XErrorEvent *err) {/*{{{*/
+    /* Clients may destroy their windows at any time, e.g. right after
+     * the client list was read. Such errors are only recorded, the
+     * callers check window_vanished() after their requests. Everything
+     * else goes to the default handler, which exits. */
+    if (err->error_code == BadAtom && ignore_bad_atoms) {
+        p_verbose("Request %lu failed, atom %lu doesn't exist.\n",
+                err->serial, err->resourceid);
+        return 0;
+    }
+    if (err->error_code == BadAccess && ignore_bad_access) {
+        bad_access = TRUE;
+        return 0;
+    }
+    if (err->error_code == BadValue && ignore_bad_value) {
+        p_verbose("Request %lu failed, the client of 0x%.8lx is gone.\n",
+                err->serial, err->resourceid);
+        g_hash_table_insert(vanished_windows,
+                GSIZE_TO_POINTER(err->resourceid), GSIZE_TO_POINTER(err->serial));
+        return 0;
+    }
+    if (err->error_code == BadWindow || err->error_code == BadDrawable) {
+        p_verbose("Request %lu failed, window 0x%.8lx doesn't exist.\n",
+                err->serial, err->resourceid);
+        g_hash_table_insert(vanished_windows,
+                GSIZE_TO_POINTER(err->resourceid), GSIZE_TO_POINTER(err->serial));
+        return 0;
+    }
+
+    return default_error_handler(disp, err);
+}/*}}}*/
+
+static void init_error_handler (void) {/*{{{*/
+    vanished_windows = g_hash_table_new(g_direct_hash, g_direct_equal);
+    default_error_handler = XSetErrorHandler(error_handler);
+}/*}}}*/
+
+static gboolean window_vanished (Window win, unsigned long serial) {/*{{{*/
+    /* Did any request for the window fail since the given serial number
+     * (taken with NextRequest() before the requests were issued)? Replies
+     * of synchronous requests are processed in order, so the errors of
+     * all earlier requests have been seen by the time they return. */
+    gpointer failed;
+
+    if (! vanished_windows || ! g_hash_table_lookup_extended(vanished_windows,
+                GSIZE_TO_POINTER(win), NULL, &failed)) {
+        return FALSE;
+    }
+    return GPOINTER_TO_SIZE(failed) >= serial;
+}/*}}}*/
+
+static void interrupt_handler (int sig) {/*{{{*/
+    interrupted = 1;
+}/*}}}*/
+
+static void init_interrupt_handler (void) {/*{{{*/
+    /* without SA_RESTART, so that poll() in wait_for_input() returns */
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = interrupt_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+}/*}}}*/
+
+static gboolean wait_for_input (Display *disp, gint64 deadline) {/*{{{*/
+    /* Wait until the X connection is readable, the given deadline
+     * (monotonic microseconds, -1 means none) or the --timeout
+     * deadline passes, or a signal interrupts a long running mode.
+     * Only the --timeout deadline sets timed_out. */
+    struct pollfd pfd;
+    int timeout = -1;
+
+    pfd.fd = ConnectionNumber(disp);
+    pfd.events = POLLIN;
+
+    if (timeout_deadline >= 0 && (deadline < 0 || timeout_deadline <= deadline)) {
+        deadline = timeout_deadline;
+    }
+
+    if (deadline >= 0) {
+        gint64 left = deadline - g_get_monotonic_time();
+        if (left <= 0) {
+            if (deadline == timeout_deadline) {
+                timed_out = TRUE;
+            }
+            return FALSE;
+        }
+        timeout = (left + 999) / 1000;
+    }
+
+    if (interrupted) {
+        return FALSE;
+    }
+    if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+        return FALSE;
+    }
+    return ! interrupted;
+}/*}}}*/
+
+static gboolean next_event (Display *disp, XEvent *event, /*{{{*/
+        gint64 deadline) {
+    /* XNextEvent() which gives up at the deadline or at --timeout */
+
+    /* XPending() flushes the output buffer and reads what's available */
+    while (! XPending(disp)) {
+        if (! wait_for_input(disp, deadline)) {
+            return FALSE;
+        }
+    }
+
+    XNextEvent(disp, event);
+    return TRUE;
+}/*}}}*/
+
+static gboolean next_window_event (Display *disp, Window win, /*{{{*/
+        long mask, XEvent *event) {
+    /* XWindowEvent() which gives up at the --timeout deadline */
+    while (! XCheckWindowEvent(disp, win, mask, event)) {
+        if (! wait_for_input(disp, -1)) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}/*}}}*/
+
+static int client_msg(Display *disp, Window win, char *msg, /* {{{ */
+    unsigned long data0, unsigned long data1,
+    unsigned long data2, unsigned long data3,
+    unsigned long data4) {
+  XEvent event;
+  long mask = SubstructureRedirectMask | SubstructureNotifyMask;
+
+  event.xclient.type = ClientMessage;
+  event.xclient.serial = 0;
+  event.xclient.send_event = True;
+  event.xclient.message_type = XInternAtom(disp, msg, False);
+  event.xclient.window = win;
+  event.xclient.format = 32;
+  event.xclient.data.l[0] = data0;
+  event.xclient.data.l[1] = data1;
+  event.xclient.data.l[2] = data2;
+  event.xclient.data.l[3] = data3;
+  event.xclient.data.l[4] = data4;
+
+  if (XSendEvent(disp, DefaultRootWindow(disp), False, mask, &event)) {
+    return EXIT_SUCCESS;
+  }
+  else {
     fprintf(stderr, "Cannot send %s event.\n", msg);
     return EXIT_FAILURE;
   }
 }/*}}}*/
 
-static gchar *get_output_str (gchar *str, gboolean is_utf8) {/*{{{*/
-  gchar *out;
+static gboolean str_is_ascii (const gchar *str, gsize len) {/*{{{*/
+  /* Window titles are mostly plain ASCII, which needs no conversion
+   * from or to any charset wmctrl can work with. The len bytes of str
+   * are scanned a word at a time, the last partial word bytewise, so
+   * nothing past them is read. */
+  const gsize highs = (gsize)-1 / 0xff * 0x80;  /* 0x8080...80 */
+  const guchar *p = (const guchar *)str;
+  const guchar *end = p + len;
+  gsize w;
+
+  for (; (gsize)(end - p) >= sizeof(w); p += sizeof(w)) {
+    memcpy(&w, p, sizeof(w));
+    if (w & highs) {
+      return FALSE;
+    }
+  }
+  for (; p < end; p++) {
+    if (*p & 0x80) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}/*}}}*/
 
-  if (str == NULL) {
-    return NULL;
+static gboolean needs_conversion (const gchar *str) {/*{{{*/
+  /* is a conversion between the locale charset and UTF-8 a no-op? */
+  if (str_is_ascii(str, strlen(str))) {
+    return FALSE;
   }
+  return ! (locale_is_utf8 && g_utf8_validate(str, -1, NULL));
+}/*}}}*/
 
-  if (envir_utf8) {
-    if (is_utf8) {
-      out = g_strdup(str);
-    }
-    else {
-      if (! (out = g_locale_to_utf8(str, -1, NULL, NULL, NULL))) {
-        p_verbose("Cannot convert string from locale charset to UTF-8.\n");
-        out = g_strdup(str);
-      }
+static gchar *convert_charset (const gchar *str, gboolean to_utf8) {/*{{{*/
+  /* like g_locale_to_utf8() and g_locale_from_utf8(), but without
+   * opening a new iconv descriptor for every string */
+  GIConv *conv = to_utf8 ? &locale_to_utf8_conv : &locale_from_utf8_conv;
+
+  if (*conv == (GIConv)-1) {
+    *conv = to_utf8 ? g_iconv_open("UTF-8", locale_charset) :
+      g_iconv_open(locale_charset, "UTF-8");
+    if (*conv == (GIConv)-1) {
+      p_verbose("Cannot open converter between %s and UTF-8.\n", locale_charset);
+      return NULL;
     }
   }
-  else {
+
+  return g_convert_with_iconv(str, -1, *conv, NULL, NULL, NULL);
+}/*}}}*/
+
+static gchar *locale_to_utf8 (const gchar *str) {/*{{{*/
+  /* returns a newly allocated string or NULL */
+  if (! needs_conversion(str)) {
+    return g_strdup(str);
+  }
+  return convert_charset(str, TRUE);
+}/*}}}*/
+
+static gchar *take_output_str (gchar *str, gboolean is_utf8) {/*{{{*/
+  /* Like get_output_str(), but takes the ownership of str. It's
+   * returned as it is when no conversion is needed. */
+  gchar *out;
+
+  if (str == NULL || !envir_utf8 == !is_utf8 || ! needs_conversion(str)) {
+    return str;
+  }
+
+  if (! (out = convert_charset(str, !is_utf8))) {
     if (is_utf8) {
-      if (! (out = g_locale_from_utf8(str, -1, NULL, NULL, NULL))) {
-        p_verbose("Cannot convert string from UTF-8 to locale charset.\n");
-        out = g_strdup(str);
-      }
+      p_verbose("Cannot convert string from UTF-8 to locale charset.\n");
     }
     else {
-      out = g_strdup(str);
+      p_verbose("Cannot convert string from locale charset to UTF-8.\n");
     }
+    return str;
   }
 
+  g_free(str);
   return out;
 }/*}}}*/
 
+static gchar *get_output_str (gchar *str, gboolean is_utf8) {/*{{{*/
+  if (str == NULL) {
+    return NULL;
+  }
+  return take_output_str(g_strdup(str), is_utf8);
+}/*}}}*/
+
 static int wm_info (Display *disp) {/*{{{*/
   Window *sup_window = NULL;
   gchar *wm_name = NULL;
@@ -652,6 +1805,115 @@ static int switch_desktop (Display *disp) {/*{{{*/
       (unsigned long)target, 0, 0, 0, 0);
 }/*}}}*/
 
+static int relocate_desktops (Display *disp, int mode) {/*{{{*/
+    /* --move-desktop A:B, --swap-desktops A:B and --merge-desktops A,B:C.
+     * The desktops of all the clients are read in one burst through
+     * XCB and the windows which have to move are sent to their new
+     * desktops in one flush. Sticky windows stay on all desktops. */
+    const char *arg = options.param;
+    unsigned long *n_desktops;
+    unsigned long target, src[2];
+    gchar *prefix, **sources;
+    const char *colon;
+    char *end;
+    Window *client_list;
+    unsigned long client_list_size;
+    xcb_get_property_cookie_t *cookies;
+    GArray *from, *to;
+    int i, j, n, moved = 0;
+    int ret = EXIT_SUCCESS;
+
+    if (! (n_desktops = (unsigned long *)get_property(disp,
+            DefaultRootWindow(disp), XA_CARDINAL, "_NET_NUMBER_OF_DESKTOPS", NULL))) {
+        fputs("Cannot get number of desktops properties. "
+              "(_NET_NUMBER_OF_DESKTOPS)\n", stderr);
+        return EXIT_FAILURE;
+    }
+    from = g_array_new(FALSE, FALSE, sizeof(unsigned long));
+    to = g_array_new(FALSE, FALSE, sizeof(unsigned long));
+
+    /* <DESK>[,<DESK>...]:<DESK> */
+    if (! (colon = strchr(arg, ':')) ||
+            (target = strtoul(colon + 1, &end, 10), end == colon + 1 || *end) ||
+            target >= *n_desktops) {
+        fprintf(stderr, "Invalid target desktop in \"%s\". There are %lu desktops.\n",
+                arg, *n_desktops);
+        ret = EXIT_FAILURE;
+        goto done;
+    }
+    prefix = g_strndup(arg, colon - arg);
+    sources = g_strsplit(prefix, ",", 0);
+    g_free(prefix);
+    for (i = 0; sources[i]; i++) {
+        unsigned long desktop = strtoul(sources[i], &end, 10);
+        if (end == sources[i] || *end || desktop >= *n_desktops ||
+                (mode != OPT_MERGE_DESKTOPS && i > 0)) {
+            fprintf(stderr, "Invalid source desktop in \"%s\". There are %lu desktops.\n",
+                    arg, *n_desktops);
+            ret = EXIT_FAILURE;
+            break;
+        }
+        g_array_append_val(from, desktop);
+        g_array_append_val(to, target);
+    }
+    g_strfreev(sources);
+    if (ret != EXIT_SUCCESS) {
+        goto done;
+    }
+    if (mode == OPT_SWAP_DESKTOPS) {
+        src[0] = target;
+        src[1] = g_array_index(from, unsigned long, 0);
+        g_array_append_val(from, src[0]);
+        g_array_append_val(to, src[1]);
+    }
+
+    if ((client_list = get_client_list(disp, &client_list_size)) == NULL) {
+        ret = EXIT_FAILURE;
+        goto done;
+    }
+
+    n = filter_windows_by_state(disp, client_list,
+            client_list_size / sizeof(Window));
+    cookies = g_new(xcb_get_property_cookie_t, n + 1);
+    for (i = 0; i < n; i++) {
+        cookies[i] = get_property_request(disp, client_list[i],
+                XA_CARDINAL, "_NET_WM_DESKTOP");
+    }
+
+    for (i = 0; i < n; i++) {
+        unsigned long *desktop = (unsigned long *)get_property_reply(disp,
+                cookies[i], XA_CARDINAL, NULL, NULL);
+
+        /* Xlib sign extends the cardinal, so only its low 32 bits count */
+        if (! desktop || (guint32)*desktop == STICKY_DESKTOP) {
+            g_free(desktop);
+            continue;
+        }
+        for (j = 0; j < from->len; j++) {
+            if (*desktop == g_array_index(from, unsigned long, j) &&
+                    *desktop != g_array_index(to, unsigned long, j)) {
+                p_verbose("0x%.8lx: %lu -> %lu\n", client_list[i], *desktop,
+                        g_array_index(to, unsigned long, j));
+                client_msg(disp, client_list[i], "_NET_WM_DESKTOP",
+                        g_array_index(to, unsigned long, j), 0, 0, 0, 0);
+                moved++;
+                break;
+            }
+        }
+        g_free(desktop);
+    }
+    XFlush(disp);
+    p_verbose("Moved %d windows.\n", moved);
+    g_free(cookies);
+    g_free(client_list);
+
+done:
+    g_array_free(from, TRUE);
+    g_array_free(to, TRUE);
+    g_free(n_desktops);
+    return ret;
+}/*}}}*/
+
 static void window_set_title (Display *disp, Window win, /* {{{ */
     char *title, char mode) {
   gchar *title_utf8;
@@ -662,7 +1924,7 @@ static void window_set_title (Display *disp, Window win, /* {{{ */
     title_local = NULL;
   }
   else {
-    if (! (title_utf8 = g_locale_to_utf8(title, -1, NULL, NULL, NULL))) {
+    if (! (title_utf8 = locale_to_utf8(title))) {
       title_utf8 = g_strdup(title);
     }
     title_local = g_strdup(title);
@@ -762,17 +2024,29 @@ static int close_window (Display *disp, Window win) {/*{{{*/
             0, 0, 0, 0, 0);
 }/*}}}*/
 
+/* Short names of the window states. The position of a name in this
+ * list is its bit in the state masks used by --state and --show-state. */
+static const char *wm_state_names[] = {
+    "modal", "sticky", "maximized_vert", "maximized_horz",
+    "shaded", "skip_taskbar", "skip_pager", "hidden",
+    "fullscreen", "above", "below", "undecorated", 0};
+
+#define WM_STATE_COUNT (G_N_ELEMENTS(wm_state_names) - 1)
+
+/* atom -> bit table for decoding _NET_WM_STATE, built on first use */
+static Atom wm_state_atoms[WM_STATE_COUNT];
+static gboolean wm_state_atoms_ready = FALSE;
+
 static gchar * normalize_wm_state_name(const char * name)
 {
-    char * short_names[] = {
-        "modal", "sticky", "maximized_vert", "maximized_horz",
-        "shaded", "skip_taskbar", "skip_pager", "hidden",
-        "fullscreen", "above", "below", 0};
-
     int i;
-    for (i = 0; short_names[i]; i++)
+    for (i = 0; wm_state_names[i]; i++)
     {
-        if (strcmp(short_names[i], name) == 0)
+        if (strcmp("undecorated", wm_state_names[i]) == 0)
+        {
+            continue;
+        }
+        if (strcmp(wm_state_names[i], name) == 0)
         {
             gchar * upcase = g_ascii_strup(name, -1);
             gchar * result = g_strdup_printf("_NET_WM_STATE_%s", upcase);
@@ -789,6 +2063,171 @@ static gchar * normalize_wm_state_name(const char * name)
     return g_strdup(name);
 }
 
+static void init_wm_state_atoms (Display *disp) {/*{{{*/
+    char *atom_names[WM_STATE_COUNT];
+    int i;
+
+    if (wm_state_atoms_ready) {
+        return;
+    }
+
+    for (i = 0; i < WM_STATE_COUNT; i++) {
+        atom_names[i] = normalize_wm_state_name(wm_state_names[i]);
+    }
+    /* a single round trip; states unknown to the server stay None
+     * and can't appear in any _NET_WM_STATE property */
+    XInternAtoms(disp, atom_names, WM_STATE_COUNT, True, wm_state_atoms);
+    for (i = 0; i < WM_STATE_COUNT; i++) {
+        g_free(atom_names[i]);
+    }
+
+    wm_state_atoms_ready = TRUE;
+}/*}}}*/
+
+static unsigned long wm_state_bit (const char *name) {/*{{{*/
+    /* the bit of a short state name in the state masks, 0 if unknown */
+    int i;
+
+    for (i = 0; wm_state_names[i]; i++) {
+        if (strcmp(wm_state_names[i], name) == 0) {
+            return 1UL << i;
+        }
+    }
+    return 0;
+}/*}}}*/
+
+static int parse_state_filter (const char *arg) {/*{{{*/
+    gchar **items = g_strsplit(arg, ",", 0);
+    int ret = EXIT_SUCCESS;
+    int i;
+
+    for (i = 0; items[i]; i++) {
+        gboolean negate = (items[i][0] == '!');
+        const char *name = negate ? items[i] + 1 : items[i];
+        unsigned long bit = wm_state_bit(name);
+
+        if (! bit) {
+            fprintf(stderr, "Unknown window state: %s\n", name);
+            ret = EXIT_FAILURE;
+            break;
+        }
+
+        if (negate) {
+            options.state_rejected |= bit;
+        }
+        else {
+            options.state_required |= bit;
+        }
+    }
+    g_strfreev(items);
+
+    options.filter_state = 1;
+    return ret;
+}/*}}}*/
+
+static unsigned long state_from_atoms (const Atom *atoms, /*{{{*/
+        unsigned long size) {
+    /* the bits of a _NET_WM_STATE value, size in bytes; needs
+     * init_wm_state_atoms() */
+    unsigned long state = 0;
+    int i, j;
+
+    for (i = 0; i < size / sizeof(Atom); i++) {
+        for (j = 0; j < WM_STATE_COUNT; j++) {
+            if (atoms[i] == wm_state_atoms[j]) {
+                state |= 1UL << j;
+                break;
+            }
+        }
+    }
+    return state;
+}/*}}}*/
+
+static gboolean get_window_state (Display *disp, Window win, /*{{{*/
+        unsigned long *state) {
+    Atom *atoms;
+    unsigned long size;
+
+    *state = 0;
+    init_wm_state_atoms(disp);
+
+    if (! (atoms = (Atom *)get_property(disp, win,
+            XA_ATOM, "_NET_WM_STATE", &size))) {
+        return FALSE;
+    }
+
+    *state = state_from_atoms(atoms, size);
+    g_free(atoms);
+    return TRUE;
+}/*}}}*/
+
+static gboolean state_passes_filter (unsigned long state) {/*{{{*/
+    return (state & options.state_required) == options.state_required &&
+        (state & options.state_rejected) == 0;
+}/*}}}*/
+
+static gboolean window_state_matches (Display *disp, Window win) {/*{{{*/
+    unsigned long state;
+
+    if (! options.filter_state) {
+        return TRUE;
+    }
+
+    /* a missing _NET_WM_STATE means no state is set */
+    get_window_state(disp, win, &state);
+    return state_passes_filter(state);
+}/*}}}*/
+
+static int filter_windows_by_state (Display *disp, Window *wins, int n) {/*{{{*/
+    /* window_state_matches() for many windows with one round trip,
+     * keeps the matching ones at the start of wins and returns their
+     * number */
+    xcb_get_property_cookie_t *cookies;
+    int i, m = 0;
+
+    if (! options.filter_state) {
+        return n;
+    }
+
+    init_wm_state_atoms(disp);
+    cookies = g_new(xcb_get_property_cookie_t, n + 1);
+    for (i = 0; i < n; i++) {
+        cookies[i] = get_property_request(disp, wins[i],
+                XA_ATOM, "_NET_WM_STATE");
+    }
+    for (i = 0; i < n; i++) {
+        unsigned long size = 0;
+        Atom *atoms = (Atom *)get_property_reply(disp, cookies[i],
+                XA_ATOM, &size, NULL);
+
+        if (state_passes_filter(state_from_atoms(atoms, atoms ? size : 0))) {
+            wins[m++] = wins[i];
+        }
+        g_free(atoms);
+    }
+    g_free(cookies);
+    return m;
+}/*}}}*/
+
+static gchar *wm_state_str (unsigned long state) {/*{{{*/
+    GString *str = g_string_new(NULL);
+    int i;
+
+    for (i = 0; i < WM_STATE_COUNT; i++) {
+        if (state & (1UL << i)) {
+            if (str->len) {
+                g_string_append_c(str, ',');
+            }
+            g_string_append(str, wm_state_names[i]);
+        }
+    }
+    if (! str->len) {
+        g_string_append_c(str, '-');
+    }
+
+    return g_string_free(str, FALSE);
+}/*}}}*/
+
 static int window_state (Display *disp, Window win, char *arg) {/*{{{*/
     unsigned long action;
     Atom prop1 = 0;
@@ -879,63 +2318,610 @@ static gboolean wm_supports (Display *disp, const gchar *prop) {/*{{{*/
     return FALSE;
 }/*}}}*/
 
-static int window_move_resize (Display *disp, Window win, char *arg) {/*{{{*/
-    signed long grav, x, y, w, h;
-    unsigned long grflags;
-    const char *argerr = "The -e option expects a list of comma separated integers: \"gravity,X,Y,width,height\"\n";
+static int get_monitors (Display *disp, monitor_info **list) {/*{{{*/
+    /* The monitor layout is read once with XRRGetMonitors() and cached.
+     * Without RandR 1.5 the whole screen is the only monitor. */
+    static monitor_info *monitors = NULL;
+    static int n_monitors = -1;
+    XRRMonitorInfo *info = NULL;
+    int event_base, error_base;
+    int major = 0, minor = 0;
+    int i, n = 0;
+
+    if (n_monitors >= 0) {
+        *list = monitors;
+        return n_monitors;
+    }
 
-    if (!arg || strlen(arg) == 0) {
-        fputs(argerr, stderr);
-        return EXIT_FAILURE;
+    if (XRRQueryExtension(disp, &event_base, &error_base) &&
+            XRRQueryVersion(disp, &major, &minor) &&
+            (major > 1 || (major == 1 && minor >= 5))) {
+        info = XRRGetMonitors(disp, DefaultRootWindow(disp), True, &n);
+    }
+    else {
+        p_verbose("RandR 1.5 isn't available, using the whole screen as m0.\n");
     }
 
-    if (sscanf(arg, "%ld,%ld,%ld,%ld,%ld", &grav, &x, &y, &w, &h) != 5) {
-        fputs(argerr, stderr);
-        return EXIT_FAILURE;
+    if (info && n > 0) {
+        Atom *atoms = g_new(Atom, n);
+        char **names = g_new0(char *, n);
+
+        monitors = g_new0(monitor_info, n);
+        for (i = 0; i < n; i++) {
+            atoms[i] = info[i].name;
+        }
+        /* all names in a single round trip */
+        if (! XGetAtomNames(disp, atoms, n, names)) {
+            memset(names, 0, n * sizeof(char *));
+        }
+        for (i = 0; i < n; i++) {
+            monitors[i].name = g_strdup(names[i] ? names[i] : "N/A");
+            monitors[i].x = info[i].x;
+            monitors[i].y = info[i].y;
+            monitors[i].width = info[i].width;
+            monitors[i].height = info[i].height;
+            monitors[i].primary = info[i].primary;
+            if (names[i]) {
+                XFree(names[i]);
+            }
+        }
+        g_free(names);
+        g_free(atoms);
+        n_monitors = n;
+    }
+    else {
+        monitors = g_new0(monitor_info, 1);
+        monitors->name = g_strdup("screen");
+        monitors->width = DisplayWidth(disp, DefaultScreen(disp));
+        monitors->height = DisplayHeight(disp, DefaultScreen(disp));
+        monitors->primary = TRUE;
+        n_monitors = 1;
+    }
+    if (info) {
+        XRRFreeMonitors(info);
     }
 
-    if (grav < 0) {
-        fputs("Value of gravity mustn't be negative. Use zero to use the default gravity of the window.\n", stderr);
-        return EXIT_FAILURE;
+    for (i = 0; i < n_monitors; i++) {
+        p_verbose("m%d: %s %dx%d+%d+%d%s\n", i, monitors[i].name,
+                monitors[i].width, monitors[i].height,
+                monitors[i].x, monitors[i].y,
+                monitors[i].primary ? " primary" : "");
     }
 
-    grflags = grav;
-    if (x != -1) grflags |= (1 << 8);
-    if (y != -1) grflags |= (1 << 9);
-    if (w != -1) grflags |= (1 << 10);
-    if (h != -1) grflags |= (1 << 11);
+    *list = monitors;
+    return n_monitors;
+}/*}}}*/
 
-    p_verbose("grflags: %lu\n", grflags);
+static int window_monitor (Display *disp, int x, int y,
+        int width, int height) {/*{{{*/
+    /* the monitor with the largest part of the rectangle, -1 if none */
+    monitor_info *monitors;
+    int n = get_monitors(disp, &monitors);
+    long best_area = 0;
+    int best = -1;
+    int i;
 
-    if (wm_supports(disp, "_NET_MOVERESIZE_WINDOW")){
-        return client_msg(disp, win, "_NET_MOVERESIZE_WINDOW",
-            grflags, (unsigned long)x, (unsigned long)y, (unsigned long)w, (unsigned long)h);
-    }
-    else {
-        p_verbose("WM doesn't support _NET_MOVERESIZE_WINDOW. Gravity will be ignored.\n");
-        if ((w < 1 || h < 1) && (x >= 0 && y >= 0)) {
-            XMoveWindow(disp, win, x, y);
+    for (i = 0; i < n; i++) {
+        long w = MIN(x + width, monitors[i].x + monitors[i].width) -
+                MAX(x, monitors[i].x);
+        long h = MIN(y + height, monitors[i].y + monitors[i].height) -
+                MAX(y, monitors[i].y);
+        if (w > 0 && h > 0 && w * h > best_area) {
+            best_area = w * h;
+            best = i;
         }
-        else if ((x < 0 || y < 0) && (w >= 1 && h >= -1)) {
-            XResizeWindow(disp, win, w, h);
-        }
-        else if (x >= 0 && y >= 0 && w >= 1 && h >= 1) {
-            XMoveResizeWindow(disp, win, x, y, w, h);
-        }
-        return EXIT_SUCCESS;
     }
+    return best;
 }/*}}}*/
 
-static int window_say_title (Display *disp, Window win) {
-    gchar *title_utf8 = get_window_title(disp, win);
+static gboolean parse_move_resize_arg (const char *arg, long *grav,
+        int *monitor, long *v, gboolean *percent) {/*{{{*/
+    /* "<G>,[m<N>:]<X>,<Y>,<W>,<H>", each of X, Y, W, H may end with % */
+    const char *p = arg;
+    char *end;
+    int i;
+
+    *grav = strtol(p, &end, 10);
+    if (end == p || *end != ',') {
+        return FALSE;
+    }
+    p = end + 1;
+
+    *monitor = -1;
+    if (*p == 'm') {
+        *monitor = strtol(p + 1, &end, 10);
+        if (end == p + 1 || *end != ':' || *monitor < 0) {
+            return FALSE;
+        }
+        p = end + 1;
+    }
+
+    for (i = 0; i < 4; i++) {
+        v[i] = strtol(p, &end, 10);
+        if (end == p) {
+            return FALSE;
+        }
+        if ((percent[i] = (*end == '%'))) {
+            end++;
+        }
+        if (*end != (i < 3 ? ',' : '\0')) {
+            return FALSE;
+        }
+        p = end + 1;
+    }
+    return TRUE;
+}/*}}}*/
+
+static int send_move_resize (Display *disp, Window win, /*{{{*/
+        unsigned long grflags, signed long x, signed long y,
+        signed long w, signed long h, gboolean netwm) {
+    if (netwm) {
+        return client_msg(disp, win, "_NET_MOVERESIZE_WINDOW",
+            grflags, (unsigned long)x, (unsigned long)y, (unsigned long)w, (unsigned long)h);
+    }
+    if ((w < 1 || h < 1) && (x >= 0 && y >= 0)) {
+        XMoveWindow(disp, win, x, y);
+    }
+    else if ((x < 0 || y < 0) && (w >= 1 && h >= -1)) {
+        XResizeWindow(disp, win, w, h);
+    }
+    else if (x >= 0 && y >= 0 && w >= 1 && h >= 1) {
+        XMoveResizeWindow(disp, win, x, y, w, h);
+    }
+    return EXIT_SUCCESS;
+}/*}}}*/
+
+static int window_move_resize (Display *disp, Window win, char *arg) {/*{{{*/
+    gboolean netwm = wm_supports(disp, "_NET_MOVERESIZE_WINDOW");
+
+    if (! netwm) {
+        p_verbose("WM doesn't support _NET_MOVERESIZE_WINDOW. Gravity will be ignored.\n");
+    }
+    return move_resize_window(disp, win, arg, netwm);
+}/*}}}*/
+
+static int move_resize_window (Display *disp, Window win, /*{{{*/
+        char *arg, gboolean netwm) {
+    /* window_move_resize() with the support of _NET_MOVERESIZE_WINDOW
+     * looked up by the caller */
+    signed long grav, x, y, w, h;
+    signed long v[4];
+    gboolean percent[4];
+    int monitor;
+    unsigned long grflags;
+    const char *argerr = "The -e option expects a list of comma separated integers: \"gravity,X,Y,width,height\"\n";
+
+    if (!arg || strlen(arg) == 0) {
+        fputs(argerr, stderr);
+        return EXIT_FAILURE;
+    }
+
+    if (! parse_move_resize_arg(arg, &grav, &monitor, v, percent)) {
+        fputs(argerr, stderr);
+        return EXIT_FAILURE;
+    }
+
+    /* make the values relative to the monitor (or the whole screen
+     * for percentages without a monitor) absolute */
+    if (monitor >= 0 || percent[0] || percent[1] || percent[2] || percent[3]) {
+        monitor_info *monitors;
+        monitor_info area;
+        int n = get_monitors(disp, &monitors);
+        int i;
+
+        if (monitor >= n) {
+            fprintf(stderr, "There is no monitor m%d, the last one is m%d.\n",
+                    monitor, n - 1);
+            return EXIT_FAILURE;
+        }
+        if (monitor >= 0) {
+            area = monitors[monitor];
+        }
+        else {
+            memset(&area, 0, sizeof(area));
+            area.width = DisplayWidth(disp, DefaultScreen(disp));
+            area.height = DisplayHeight(disp, DefaultScreen(disp));
+        }
+        for (i = 0; i < 4; i++) {
+            if (v[i] == -1 && ! percent[i]) {
+                continue;
+            }
+            if (percent[i]) {
+                v[i] = v[i] * (i % 2 ? area.height : area.width) / 100;
+            }
+            if (monitor >= 0 && i < 2) {
+                v[i] += i ? area.y : area.x;
+            }
+        }
+    }
+    x = v[0];
+    y = v[1];
+    w = v[2];
+    h = v[3];
+
+    if (grav < 0) {
+        fputs("Value of gravity mustn't be negative. Use zero to use the default gravity of the window.\n", stderr);
+        return EXIT_FAILURE;
+    }
+
+    grflags = grav;
+    if (x != -1) grflags |= (1 << 8);
+    if (y != -1) grflags |= (1 << 9);
+    if (w != -1) grflags |= (1 << 10);
+    if (h != -1) grflags |= (1 << 11);
+
+    p_verbose("grflags: %lu\n", grflags);
+
+    return send_move_resize(disp, win, grflags, x, y, w, h, netwm);
+}/*}}}*/
+
+#define DEFAULT_STREAM_FPS 60
+
+typedef struct {
+    signed long v[4];   /* x, y, w, h */
+    gboolean pending;   /* changed since the last frame */
+} stream_target;
+
+static gboolean parse_stream_line (const char *line, Window default_win, /*{{{*/
+        Window *win, signed long v[4]) {
+    /* [<ID> ]<X>,<Y>,<W>,<H> */
+    unsigned long wid;
+    int n = 0;
+
+    *win = default_win;
+    if (sscanf(line, " 0x%lx %n", &wid, &n) == 1 && n > 0) {
+        *win = wid;
+        line += n;
+    }
+    n = 0;
+    if (sscanf(line, " %ld , %ld , %ld , %ld %n", &v[0], &v[1], &v[2], &v[3],
+                &n) != 4 || line[n] != '\0') {
+        return FALSE;
+    }
+    return TRUE;
+}/*}}}*/
+
+static int stream_geometry (Display *disp, Window win) {/*{{{*/
+    /* Read "x,y,w,h" lines (optionally prefixed with a window ID) from
+     * the standard input and move the windows at most once per frame
+     * on this connection. The lines which arrive within one frame are
+     * coalesced to the latest geometry of each window. A frame is
+     * dropped when wmctrl falls behind its schedule by a whole frame. */
+    GHashTable *targets = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, g_free);
+    GString *buf = g_string_new(NULL);
+    gint64 frame = G_USEC_PER_SEC / (options.fps ? options.fps : DEFAULT_STREAM_FPS);
+    gint64 next_frame = -1, first_frame = -1, last_frame = -1;
+    unsigned long lines = 0, invalid = 0, coalesced = 0;
+    unsigned long frames = 0, dropped = 0, requests = 0;
+    gboolean netwm, eof = FALSE;
+    char chunk[4096];
+
+    /* checked once, not per request */
+    netwm = wm_supports(disp, "_NET_MOVERESIZE_WINDOW");
+    if (! netwm) {
+        p_verbose("WM doesn't support _NET_MOVERESIZE_WINDOW. Gravity will be ignored.\n");
+    }
+    init_interrupt_handler();
+
+    while (! interrupted) {
+        struct pollfd pfd[2];
+        gint64 now = g_get_monotonic_time();
+        gint64 deadline = next_frame;
+        int timeout = -1;
+        char *nl;
+
+        /* send a frame when it's due, or right away at the end */
+        if (next_frame >= 0 && (now >= next_frame || eof)) {
+            GHashTableIter iter;
+            gpointer key, value;
+
+            if (now - next_frame >= frame && ! eof) {
+                dropped += (now - next_frame) / frame;
+            }
+            g_hash_table_iter_init(&iter, targets);
+            while (g_hash_table_iter_next(&iter, &key, &value)) {
+                stream_target *t = value;
+                unsigned long grflags = 0;
+                int i;
+
+                if (! t->pending) {
+                    continue;
+                }
+                for (i = 0; i < 4; i++) {
+                    if (t->v[i] != -1) grflags |= (1 << (8 + i));
+                }
+                send_move_resize(disp, (Window)GPOINTER_TO_SIZE(key), grflags,
+                        t->v[0], t->v[1], t->v[2], t->v[3], netwm);
+                t->pending = FALSE;
+                requests++;
+            }
+            XFlush(disp);
+            frames++;
+            last_frame = now;
+            if (first_frame < 0) {
+                first_frame = now;
+            }
+            next_frame = -1;
+        }
+        if (eof) {
+            break;
+        }
+
+        /* --timeout covers the whole stream */
+        if (timeout_deadline >= 0) {
+            if (now >= timeout_deadline) {
+                timed_out = TRUE;
+                break;
+            }
+            if (deadline < 0 || timeout_deadline < deadline) {
+                deadline = timeout_deadline;
+            }
+        }
+        if (deadline >= 0) {
+            timeout = MAX(0, (deadline - now + 999) / 1000);
+        }
+
+        pfd[0].fd = STDIN_FILENO;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = ConnectionNumber(disp);
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, timeout) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+
+        /* errors of earlier requests go to the error handler */
+        if (pfd[1].revents) {
+            XEvent event;
+            while (XPending(disp)) {
+                XNextEvent(disp, &event);
+            }
+        }
+
+        if (pfd[0].revents) {
+            ssize_t n = read(STDIN_FILENO, chunk, sizeof(chunk));
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                eof = TRUE;
+                /* a last line without the newline */
+                if (buf->len) {
+                    g_string_append_c(buf, '\n');
+                }
+            }
+            else {
+                g_string_append_len(buf, chunk, n);
+            }
+        }
+
+        while ((nl = memchr(buf->str, '\n', buf->len)) != NULL) {
+            signed long v[4];
+            Window target;
+            stream_target *t;
+
+            *nl = '\0';
+            lines++;
+            if (! parse_stream_line(buf->str, win, &target, v)) {
+                fprintf(stderr, "stdin:%lu: Expected \"[<ID> ]X,Y,W,H\".\n", lines);
+                invalid++;
+            }
+            else {
+                if (! (t = g_hash_table_lookup(targets, GSIZE_TO_POINTER(target)))) {
+                    t = g_new0(stream_target, 1);
+                    g_hash_table_insert(targets, GSIZE_TO_POINTER(target), t);
+                }
+                if (t->pending) {
+                    coalesced++;
+                }
+                memcpy(t->v, v, sizeof(t->v));
+                t->pending = TRUE;
+
+                /* the first change after a pause goes out at once */
+                if (next_frame < 0) {
+                    now = g_get_monotonic_time();
+                    next_frame = last_frame < 0 ? now : MAX(now, last_frame + frame);
+                }
+            }
+            g_string_erase(buf, 0, nl - buf->str + 1);
+        }
+    }
+
+    printf("lines %lu, invalid %lu, coalesced %lu, frames %lu, dropped %lu, "
+            "requests %lu, %.1f fps\n", lines, invalid, coalesced, frames,
+            dropped, requests, frames > 1 && last_frame > first_frame ?
+            (frames - 1) * (double)G_USEC_PER_SEC / (last_frame - first_frame) : 0.0);
+
+    g_string_free(buf, TRUE);
+    g_hash_table_destroy(targets);
+    return timed_out || invalid ? EXIT_FAILURE : EXIT_SUCCESS;
+}/*}}}*/
+
+static int window_say_title (Display *disp, Window win) {
+    gchar *title_utf8 = get_window_title(disp, win);
     printf("%s\n", title_utf8);
     g_free(title_utf8);
     return EXIT_SUCCESS;
 }
 
-static int action_window (Display *disp, Window win, char mode) {/*{{{*/
+static int client_index (const Window *clients, int n, Window win) {/*{{{*/
+    int i;
+
+    for (i = 0; win && i < n; i++) {
+        if (clients[i] == win) {
+            return i;
+        }
+    }
+    return -1;
+}/*}}}*/
+
+static void get_client_parents (Display *disp, const Window *clients, /*{{{*/
+        int n, gboolean groups, int *parents) {
+    /* The index of the parent of each client, -1 for none. A transient
+     * belongs to the window it's transient for. With groups, any other
+     * window belongs to the leader of its group (WM_HINTS or
+     * WM_CLIENT_LEADER), if the leader is one of the clients. Cycles
+     * are broken. The requests for all the clients go out through XCB
+     * in one burst. */
+    GHashTable *index = g_hash_table_new(g_direct_hash, g_direct_equal);
+    xcb_get_property_cookie_t *cookies =
+        g_new(xcb_get_property_cookie_t, 3 * n + 1);
+    int i, j, steps;
+
+    for (i = 0; i < n; i++) {
+        g_hash_table_insert(index, GSIZE_TO_POINTER(clients[i]),
+                GINT_TO_POINTER(i + 1));
+        cookies[3 * i] = get_property_request(disp, clients[i],
+                XA_WINDOW, "WM_TRANSIENT_FOR");
+        if (groups) {
+            cookies[3 * i + 1] = get_property_request(disp, clients[i],
+                    XA_WINDOW, "WM_CLIENT_LEADER");
+            cookies[3 * i + 2] = get_property_request(disp, clients[i],
+                    XA_WM_HINTS, "WM_HINTS");
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        Window *transient_for, *leader = NULL;
+        unsigned long *hints = NULL;
+        unsigned long size;
+        Window parent = 0;
+
+        transient_for = (Window *)get_property_reply(disp, cookies[3 * i],
+                XA_WINDOW, NULL, NULL);
+        if (groups) {
+            leader = (Window *)get_property_reply(disp, cookies[3 * i + 1],
+                    XA_WINDOW, NULL, NULL);
+            hints = (unsigned long *)get_property_reply(disp,
+                    cookies[3 * i + 2], XA_WM_HINTS, &size, NULL);
+        }
+
+        if (transient_for &&
+                g_hash_table_lookup(index, GSIZE_TO_POINTER(*transient_for))) {
+            parent = *transient_for;
+        }
+        else if (hints && size >= 9 * sizeof(unsigned long) &&
+                (hints[0] & WindowGroupHint)) {
+            parent = hints[8];
+        }
+        else if (leader) {
+            parent = *leader;
+        }
+
+        parents[i] = parent == clients[i] ? -1 :
+            GPOINTER_TO_INT(g_hash_table_lookup(index,
+                        GSIZE_TO_POINTER(parent))) - 1;
+        g_free(transient_for);
+        g_free(leader);
+        g_free(hints);
+    }
+    g_free(cookies);
+
+    /* a window which is its own ancestor is on a cycle, which is
+     * broken by making it a root */
+    for (i = 0; i < n; i++) {
+        for (j = parents[i], steps = 0; j >= 0 && steps < n; j = parents[j]) {
+            if (j == i) {
+                parents[i] = -1;
+                break;
+            }
+            steps++;
+        }
+    }
+
+    g_hash_table_destroy(index);
+}/*}}}*/
+
+static void tree_order (const int *parents, int n, int node, /*{{{*/
+        int depth, int *order, int *depths, int *count) {
+    /* pre-order: a window, then its children in the client list order */
+    int i;
+
+    order[*count] = node;
+    depths[(*count)++] = depth;
+    for (i = 0; i < n; i++) {
+        if (parents[i] == node) {
+            tree_order(parents, n, i, depth + 1, order, depths, count);
+        }
+    }
+}/*}}}*/
+
+static void collect_descendants (const Window *clients, /*{{{*/
+        const int *parents, int n, int node, GArray *out) {
+    /* post-order: the children come before their parent */
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (parents[i] == node) {
+            collect_descendants(clients, parents, n, i, out);
+            g_array_append_val(out, clients[i]);
+        }
+    }
+}/*}}}*/
+
+static int action_window_with_children (Display *disp, Window win, /*{{{*/
+        int mode) {
+    /* the action for the transients of the window (and theirs) first,
+     * then for the window itself */
+    Window *client_list;
+    unsigned long client_list_size;
+    GArray *windows = g_array_new(FALSE, FALSE, sizeof(Window));
+    int *parents;
+    int n, i, ret = EXIT_SUCCESS;
+
+    if ((client_list = get_client_list(disp, &client_list_size)) != NULL) {
+        n = client_list_size / sizeof(Window);
+        parents = g_new(int, n);
+        /* only the transients, not the other windows of the group */
+        get_client_parents(disp, client_list, n, FALSE, parents);
+        if ((i = client_index(client_list, n, win)) >= 0) {
+            collect_descendants(client_list, parents, n, i, windows);
+        }
+        g_free(parents);
+        g_free(client_list);
+    }
+    g_array_append_val(windows, win);
+
+    options.with_children = 0;
+    for (i = 0; i < windows->len; i++) {
+        if (action_window(disp, g_array_index(windows, Window, i), mode)
+                != EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
+        }
+    }
+    options.with_children = 1;
+
+    g_array_free(windows, TRUE);
+    return ret;
+}/*}}}*/
+
+static int action_window (Display *disp, Window win, int mode) {/*{{{*/
+    /* The error handler only records the errors of the action's
+     * requests. Those which waited for a reply have been seen when the
+     * action returns; the errors of the rest show up at the next round
+     * trip, no XSync() is forced for them. */
+    unsigned long serial;
     int rv;
+
+    if (options.with_children) {
+        return action_window_with_children(disp, win, mode);
+    }
     p_verbose("Using window: 0x%.8lx\n", win);
+
+    serial = NextRequest(disp);
+    rv = run_window_action(disp, win, mode);
+    if (window_vanished(win, serial)) {
+        fprintf(stderr, "Window 0x%.8lx doesn't exist.\n", win);
+        return EXIT_FAILURE;
+    }
+    return rv;
+}/*}}}*/
+
+static int run_window_action (Display *disp, Window win, int mode) {/*{{{*/
+    int rv;
     switch (mode) {
         case 'a':
             return activate_window(disp, win, TRUE);
@@ -985,111 +2971,3717 @@ static int action_window (Display *disp, Window win, char mode) {/*{{{*/
         case 'E':
             return window_say_title(disp, win);
 
+        case OPT_ICON:
+            return save_icon(disp, win, options.param_out) == EXIT_SUCCESS ?
+                EXIT_SUCCESS : EXIT_FAILURE;
+
+        case OPT_PROPS:
+            return print_window_props(disp, win);
+
+        case OPT_STREAM_GEOMETRY:
+            return stream_geometry(disp, win);
+
         default:
             fprintf(stderr, "Unknown action: '%c'\n", mode);
             return EXIT_FAILURE;
     }
 }/*}}}*/
 
-static int action_window_pid (Display *disp, char mode) {/*{{{*/
-    unsigned long wid;
-
-    if (sscanf(options.param_window, "0x%lx", &wid) != 1 &&
-            sscanf(options.param_window, "0X%lx", &wid) != 1 &&
-            sscanf(options.param_window, "%lu", &wid) != 1) {
-        fputs("Cannot convert argument to number.\n", stderr);
-        return EXIT_FAILURE;
+static gboolean parse_window_id (const char *str, unsigned long *wid) {/*{{{*/
+    if (sscanf(str, "0x%lx", wid) != 1 &&
+            sscanf(str, "0X%lx", wid) != 1 &&
+            sscanf(str, "%lu", wid) != 1) {
+        fputs("Cannot convert argument to number.\n", stderr);
+        return FALSE;
+    }
+    return TRUE;
+}/*}}}*/
+
+static int action_window_pid (Display *disp, int mode) {/*{{{*/
+    /* Most actions are client messages to the root window, which don't
+     * fail for a window that doesn't exist, so a window ID given by the
+     * user is checked first. The windows from the client list aren't. */
+    unsigned long wid;
+    unsigned long serial;
+    Window root;
+    int x, y;
+    unsigned int w, h, border, depth;
+
+    if (! parse_window_id(options.param_window, &wid)) {
+        return EXIT_FAILURE;
+    }
+
+    serial = NextRequest(disp);
+    if (! XGetGeometry(disp, (Window)wid, &root, &x, &y, &w, &h,
+                &border, &depth) || window_vanished(wid, serial)) {
+        fprintf(stderr, "Window 0x%.8lx doesn't exist.\n", wid);
+        return EXIT_FAILURE;
+    }
+
+    return action_window(disp, (Window)wid, mode);
+}/*}}}*/
+
+static inline guchar ascii_fold (guchar c) {/*{{{*/
+    return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}/*}}}*/
+
+static gboolean ascii_fold_equal (const guchar *str, /*{{{*/
+        const guchar *lower, gsize len) {
+    gsize i;
+
+    for (i = 0; i < len; i++) {
+        if (ascii_fold(str[i]) != lower[i]) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}/*}}}*/
+
+#ifdef __SSE2__
+static inline __m128i ascii_fold16 (__m128i v) {/*{{{*/
+    /* bytes >= 0x80 are negative as signed and never look uppercase */
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+            _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}/*}}}*/
+#endif
+
+static gboolean ascii_contains_nocase (const gchar *haystack, gsize hlen, /*{{{*/
+        const gchar *needle, gsize nlen) {
+    /* Case insensitive substring search for ASCII strings. The needle
+     * has to be lowercase already, the haystack is folded on the fly. */
+    const guchar *h = (const guchar *)haystack;
+    const guchar *n = (const guchar *)needle;
+    gsize i = 0;
+
+    if (nlen == 0) {
+        return TRUE;
+    }
+    if (nlen > hlen) {
+        return FALSE;
+    }
+
+#ifdef __SSE2__
+    {
+        /* compare the first and the last character of the needle at
+         * 16 positions at once, check the candidates one by one */
+        __m128i first = _mm_set1_epi8(n[0]);
+        __m128i last = _mm_set1_epi8(n[nlen - 1]);
+
+        for (; i + nlen - 1 + 16 <= hlen; i += 16) {
+            __m128i block_first = ascii_fold16(
+                    _mm_loadu_si128((const __m128i *)(h + i)));
+            __m128i block_last = ascii_fold16(
+                    _mm_loadu_si128((const __m128i *)(h + i + nlen - 1)));
+            unsigned int mask = _mm_movemask_epi8(_mm_and_si128(
+                    _mm_cmpeq_epi8(block_first, first),
+                    _mm_cmpeq_epi8(block_last, last)));
+
+            while (mask) {
+                int bit = __builtin_ctz(mask);
+                if (ascii_fold_equal(h + i + bit + 1, n + 1, nlen - 1)) {
+                    return TRUE;
+                }
+                mask &= mask - 1;
+            }
+        }
+    }
+#endif
+
+    for (; i + nlen <= hlen; i++) {
+        if (ascii_fold(h[i]) == n[0] && ascii_fold_equal(h + i + 1, n + 1, nlen - 1)) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}/*}}}*/
+
+static void match_pattern_init (match_pattern *pattern, const char *str) {/*{{{*/
+    /* str is in the locale charset */
+    if (envir_utf8 || ! (pattern->utf8 = locale_to_utf8(str))) {
+        pattern->utf8 = g_strdup(str);
+    }
+
+    pattern->ascii = str_is_ascii(pattern->utf8, strlen(pattern->utf8));
+    if (pattern->ascii) {
+        /* same as g_utf8_casefold() for ASCII */
+        pattern->casefold = g_ascii_strdown(pattern->utf8, -1);
+    }
+    else {
+        pattern->casefold = g_utf8_casefold(pattern->utf8, -1);
+    }
+    pattern->casefold_len = strlen(pattern->casefold);
+}/*}}}*/
+
+static void match_pattern_clear (match_pattern *pattern) {/*{{{*/
+    g_free(pattern->utf8);
+    g_free(pattern->casefold);
+    memset(pattern, 0, sizeof(*pattern));
+}/*}}}*/
+
+static gboolean str_matches_pattern (const gchar *str_utf8, /*{{{*/
+        const match_pattern *pattern) {
+    gchar *str_cf;
+    gsize len;
+    gboolean ret;
+
+    if (options.full_window_title_match) {
+        return strcmp(str_utf8, pattern->utf8) == 0;
+    }
+
+    /* Casefolding may map non-ASCII characters to ASCII ones (KELVIN
+     * SIGN to 'k'), so the fast path needs both strings to be ASCII */
+    len = strlen(str_utf8);
+    if (pattern->ascii && str_is_ascii(str_utf8, len)) {
+        return ascii_contains_nocase(str_utf8, len,
+                pattern->casefold, pattern->casefold_len);
+    }
+
+    str_cf = g_utf8_casefold(str_utf8, -1);
+    ret = strstr(str_cf, pattern->casefold) != NULL;
+    g_free(str_cf);
+    return ret;
+}/*}}}*/
+
+static gboolean window_matches_str (Display *disp, Window win, /*{{{*/
+        const char *str) {
+    /* the pattern is prepared once for all the windows it's matched
+     * to, it's redone when the contents of str change */
+    static gchar *prepared = NULL;
+    static match_pattern pattern;
+    gchar *match_utf8;
+    gboolean ret;
+
+    if (! window_state_matches(disp, win)) {
+        return FALSE;
+    }
+
+    if (options.show_class) {
+        match_utf8 = get_window_class(disp, win); /* UTF8 */
+    }
+    else {
+        match_utf8 = get_window_title(disp, win); /* UTF8 */
+    }
+    if (! match_utf8) {
+        return FALSE;
+    }
+
+    if (! prepared || strcmp(str, prepared) != 0) {
+        match_pattern_clear(&pattern);
+        match_pattern_init(&pattern, str);
+        g_free(prepared);
+        prepared = g_strdup(str);
+    }
+
+    ret = str_matches_pattern(match_utf8, &pattern);
+
+    g_free(match_utf8);
+    return ret;
+}/*}}}*/
+
+static gchar **get_match_strings (Display *disp, Window *wins, int n) {/*{{{*/
+    /* What window_matches_str() matches against, for many windows with
+     * one round trip: the titles, or the classes with -x, in UTF-8.
+     * The windows which are gone or fail --state get NULL. */
+    xcb_get_property_cookie_t *cookies;
+    gchar **strs = g_new0(gchar *, n + 1);
+    Atom utf8_string = XInternAtom(disp, "UTF8_STRING", False);
+    int per_win = (options.show_class ? 1 : 2) + (options.filter_state ? 1 : 0);
+    int i;
+
+    if (options.filter_state) {
+        init_wm_state_atoms(disp);
+    }
+    cookies = g_new(xcb_get_property_cookie_t, n * per_win);
+    for (i = 0; i < n; i++) {
+        xcb_get_property_cookie_t *c = cookies + i * per_win;
+
+        if (options.show_class) {
+            *c++ = get_property_request(disp, wins[i], XA_STRING, "WM_CLASS");
+        }
+        else {
+            *c++ = get_property_request(disp, wins[i], XA_STRING, "WM_NAME");
+            *c++ = get_property_request(disp, wins[i],
+                    utf8_string, "_NET_WM_NAME");
+        }
+        if (options.filter_state) {
+            *c = get_property_request(disp, wins[i], XA_ATOM, "_NET_WM_STATE");
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        xcb_get_property_cookie_t *c = cookies + i * per_win;
+        unsigned long size = 0;
+        gboolean vanished;
+
+        if (options.show_class) {
+            gchar *wm_class = get_property_reply(disp, *c++, XA_STRING,
+                    &size, &vanished);
+            strs[i] = class_from_property(wm_class, size);
+        }
+        else {
+            gchar *wm_name = get_property_reply(disp, *c++, XA_STRING,
+                    NULL, &vanished);
+            gchar *net_wm_name = get_property_reply(disp, *c++, utf8_string,
+                    NULL, NULL);
+            strs[i] = title_from_names(wm_name, net_wm_name);
+        }
+        if (options.filter_state) {
+            Atom *atoms = (Atom *)get_property_reply(disp, *c, XA_ATOM,
+                    &size, NULL);
+            if (! state_passes_filter(state_from_atoms(atoms,
+                    atoms ? size : 0))) {
+                vanished = TRUE;
+            }
+            g_free(atoms);
+        }
+        if (vanished) {
+            g_free(strs[i]);
+            strs[i] = NULL;
+        }
+    }
+
+    g_free(cookies);
+    return strs;
+}/*}}}*/
+
+#define MRU_PROPERTY "_WMCTRL_MRU"
+#define MRU_MAX 256
+
+static void mru_remove (GArray *mru, Window win) {/*{{{*/
+    int i;
+
+    for (i = 0; i < mru->len; i++) {
+        if (g_array_index(mru, Window, i) == win) {
+            g_array_remove_index(mru, i);
+            return;
+        }
+    }
+}/*}}}*/
+
+static void mru_touch (Display *disp, GArray *mru, Window win) {/*{{{*/
+    /* move the window to the front, new windows are watched for
+     * DestroyNotify */
+    int i;
+
+    for (i = 0; i < mru->len; i++) {
+        if (g_array_index(mru, Window, i) == win) {
+            break;
+        }
+    }
+    if (i == mru->len) {
+        XSelectInput(disp, win, StructureNotifyMask);
+        if (mru->len == MRU_MAX) {
+            g_array_set_size(mru, MRU_MAX - 1);
+        }
+    }
+    else {
+        g_array_remove_index(mru, i);
+    }
+    g_array_prepend_val(mru, win);
+}/*}}}*/
+
+static void mru_publish (Display *disp, GArray *mru) {/*{{{*/
+    XChangeProperty(disp, DefaultRootWindow(disp),
+            XInternAtom(disp, MRU_PROPERTY, False), XA_WINDOW, 32,
+            PropModeReplace, (unsigned char *)mru->data, mru->len);
+    XFlush(disp);
+}/*}}}*/
+
+static int track_mru (Display *disp) {/*{{{*/
+    /* Keep the windows in the order they were last active, most recent
+     * first, in the _WMCTRL_MRU property of the root window until
+     * interrupted. :PREV: and :MRU:<N> read it with a single request. */
+    Window root = DefaultRootWindow(disp);
+    Atom xa_active = XInternAtom(disp, "_NET_ACTIVE_WINDOW", False);
+    GArray *mru = g_array_new(FALSE, FALSE, sizeof(Window));
+    Window *stacking;
+    unsigned long size;
+    Window active;
+    XEvent event;
+    int i;
+
+    init_interrupt_handler();
+    XSelectInput(disp, root, PropertyChangeMask);
+
+    /* until the history builds up the stacking order is the best guess */
+    if ((stacking = (Window *)get_property(disp, root, XA_WINDOW,
+            "_NET_CLIENT_LIST_STACKING", &size))) {
+        for (i = 0; i < size / sizeof(Window); i++) {
+            mru_touch(disp, mru, stacking[i]);
+        }
+        g_free(stacking);
+    }
+    if ((active = get_active_window(disp))) {
+        mru_touch(disp, mru, active);
+    }
+    mru_publish(disp, mru);
+
+    while (next_event(disp, &event, -1)) {
+        if (event.type == PropertyNotify && event.xproperty.window == root &&
+                event.xproperty.atom == xa_active) {
+            if (! (active = get_active_window(disp)) ||
+                    (mru->len && g_array_index(mru, Window, 0) == active)) {
+                continue;
+            }
+            p_verbose("Active: 0x%.8lx\n", active);
+            mru_touch(disp, mru, active);
+            mru_publish(disp, mru);
+        }
+        else if (event.type == DestroyNotify) {
+            p_verbose("Destroyed: 0x%.8lx\n", event.xdestroywindow.window);
+            mru_remove(mru, event.xdestroywindow.window);
+            mru_publish(disp, mru);
+        }
+    }
+
+    /* a stale history is worse than none */
+    XDeleteProperty(disp, root, XInternAtom(disp, MRU_PROPERTY, False));
+    g_array_free(mru, TRUE);
+    return timed_out ? EXIT_FAILURE : EXIT_SUCCESS;
+}/*}}}*/
+
+static Window get_mru_window (Display *disp, const char *str) {/*{{{*/
+    /* :PREV: or :MRU:<N>, 0 is the active window */
+    Window *mru;
+    Window win;
+    unsigned long size, n;
+    char *end;
+
+    if (strcmp(str, PREV_WINDOW_MAGIC) == 0) {
+        n = 1;
+    }
+    else {
+        str += strlen(MRU_WINDOW_MAGIC);
+        n = strtoul(str, &end, 10);
+        if (end == str || *end) {
+            fputs("The :MRU: magic expects a number, e.g. :MRU:2\n", stderr);
+            return 0;
+        }
+    }
+
+    if (! (mru = (Window *)get_property(disp, DefaultRootWindow(disp),
+            XA_WINDOW, MRU_PROPERTY, &size))) {
+        fputs("There is no focus history. Is \"wmctrl --mru\" running?\n", stderr);
+        return 0;
+    }
+    if (n >= size / sizeof(Window)) {
+        fprintf(stderr, "The focus history has only %lu windows.\n",
+                size / sizeof(Window));
+        g_free(mru);
+        return 0;
+    }
+    win = mru[n];
+    g_free(mru);
+    return win;
+}/*}}}*/
+
+static int stack_position (Window *stack, int n, Window win) {/*{{{*/
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (stack[i] == win) {
+            return i;
+        }
+    }
+    return -1;
+}/*}}}*/
+
+static void stack_move (Window *stack, int n, Window win, /*{{{*/
+        Window sibling, gboolean above) {
+    /* move win next to sibling in the bottom to top stack */
+    int from = stack_position(stack, n, win);
+    int to;
+
+    memmove(stack + from, stack + from + 1, (n - from - 1) * sizeof(Window));
+    to = stack_position(stack, n - 1, sibling) + (above ? 1 : 0);
+    memmove(stack + to + 1, stack + to, (n - 1 - to) * sizeof(Window));
+    stack[to] = win;
+}/*}}}*/
+
+static int restack_windows (Display *disp) {/*{{{*/
+    /* Stack the listed windows directly on top of each other, the first
+     * one topmost, where the highest of them is now. The moves are
+     * computed against _NET_CLIENT_LIST_STACKING, so only the windows
+     * which are out of place are restacked. */
+    Window *stack;
+    unsigned long size;
+    gchar **entries;
+    gchar **strs = NULL;
+    Window *wins;
+    gboolean use_restack_msg = wm_supports(disp, "_NET_RESTACK_WINDOW");
+    int n_stack, n, i, k, highest;
+    int moves = 0;
+
+    if (! (stack = (Window *)get_property(disp, DefaultRootWindow(disp),
+            XA_WINDOW, "_NET_CLIENT_LIST_STACKING", &size))) {
+        fputs("Cannot get the stacking order (_NET_CLIENT_LIST_STACKING property)\n", stderr);
+        return EXIT_FAILURE;
+    }
+    n_stack = size / sizeof(Window);
+
+    /* resolve the entries, a window is used for one entry only; the
+     * strings of the stacked windows are fetched once for all of them */
+    entries = g_strsplit(options.param_window, ",", 0);
+    n = g_strv_length(entries);
+    wins = g_new0(Window, n);
+    if (! options.match_by_id) {
+        strs = get_match_strings(disp, stack, n_stack);
+    }
+    for (k = 0; k < n; k++) {
+        unsigned long wid = 0;
+
+        if (options.match_by_id) {
+            if (! parse_window_id(entries[k], &wid) ||
+                    stack_position(stack, n_stack, wid) < 0) {
+                wid = 0;
+            }
+        }
+        else {
+            match_pattern pattern;
+
+            match_pattern_init(&pattern, entries[k]);
+            for (i = n_stack - 1; i >= 0 && ! wid; i--) {
+                if (strs[i] && stack_position(wins, k, stack[i]) < 0 &&
+                        str_matches_pattern(strs[i], &pattern)) {
+                    wid = stack[i];
+                }
+            }
+            match_pattern_clear(&pattern);
+        }
+        if (! wid || stack_position(wins, k, wid) >= 0) {
+            fprintf(stderr, "No window to restack for \"%s\".\n", entries[k]);
+            g_strfreev(strs);
+            g_strfreev(entries);
+            g_free(wins);
+            g_free(stack);
+            return EXIT_FAILURE;
+        }
+        wins[k] = wid;
+    }
+    g_strfreev(strs);
+    g_strfreev(entries);
+
+    /* the first window goes above the highest one, each of the
+     * following ones directly below its predecessor */
+    for (k = 0, highest = 0; k < n; k++) {
+        if (stack_position(stack, n_stack, wins[k]) >
+                stack_position(stack, n_stack, wins[highest])) {
+            highest = k;
+        }
+    }
+    for (k = 0; k < n; k++) {
+        Window sibling = k ? wins[k - 1] : wins[highest];
+        gboolean above = k == 0;
+        int pos = stack_position(stack, n_stack, wins[k]);
+
+        if (k == 0 ? highest == 0 :
+                pos + 1 == stack_position(stack, n_stack, sibling)) {
+            continue;
+        }
+        p_verbose("0x%.8lx %s 0x%.8lx\n", wins[k],
+                above ? "above" : "below", sibling);
+        stack_move(stack, n_stack, wins[k], sibling, above);
+        if (use_restack_msg) {
+            /* source indication 2: a pager, which the WM should obey */
+            client_msg(disp, wins[k], "_NET_RESTACK_WINDOW",
+                    2, sibling, above ? Above : Below, 0, 0);
+        }
+        else {
+            XWindowChanges changes;
+            changes.sibling = sibling;
+            changes.stack_mode = above ? Above : Below;
+            /* the siblings are in different frames under a reparenting
+             * WM, then this falls back to the ICCCM synthetic
+             * ConfigureRequest instead of failing with BadMatch */
+            XReconfigureWMWindow(disp, wins[k], DefaultScreen(disp),
+                    CWSibling | CWStackMode, &changes);
+        }
+        moves++;
+    }
+
+    /* all the requests in one burst */
+    XFlush(disp);
+    p_verbose("Restacked %d of %d windows.\n", moves, n);
+
+    g_free(wins);
+    g_free(stack);
+    return EXIT_SUCCESS;
+}/*}}}*/
+
+static int action_window_str (Display *disp, int mode) {/*{{{*/
+    Window activate = 0;
+    Window *client_list;
+    unsigned long client_list_size;
+    int i;
+
+    if (strcmp(SELECT_WINDOW_MAGIC, options.param_window) == 0) {
+        activate = Select_Window(disp);
+        if (activate) {
+            return action_window(disp, activate, mode);
+        }
+        else {
+            return EXIT_FAILURE;
+        }
+    }
+    if (strcmp(ACTIVE_WINDOW_MAGIC, options.param_window) == 0) {
+        activate = get_active_window(disp);
+        if (activate)
+        {
+            return action_window(disp, activate, mode);
+        }
+        else
+        {
+            return EXIT_FAILURE;
+        }
+    }
+    if (strcmp(PREV_WINDOW_MAGIC, options.param_window) == 0 ||
+            strncmp(MRU_WINDOW_MAGIC, options.param_window,
+                strlen(MRU_WINDOW_MAGIC)) == 0) {
+        if ((activate = get_mru_window(disp, options.param_window))) {
+            return action_window(disp, activate, mode);
+        }
+        return EXIT_FAILURE;
+    }
+    else {
+        if ((client_list = get_client_list(disp, &client_list_size)) == NULL) {
+            return EXIT_FAILURE;
+        }
+
+        for (i = 0; i < client_list_size / sizeof(Window); i++) {
+            if (window_matches_str(disp, client_list[i], options.param_window)) {
+                activate = client_list[i];
+                break;
+            }
+        }
+        g_free(client_list);
+
+        if (activate) {
+            return action_window(disp, activate, mode);
+        }
+        else {
+            return EXIT_FAILURE;
+        }
+    }
+}/*}}}*/
+
+
+static gboolean window_matches_arg (Display *disp, Window win, /*{{{*/
+        const char *str, unsigned long wid) {
+    /* match a <WIN> argument, which has been converted to the
+     * window ID wid already if -i is in effect */
+    if (options.match_by_id) {
+        return win == wid && window_state_matches(disp, win);
+    }
+    return window_matches_str(disp, win, str);
+}/*}}}*/
+
+static Window wait_scan_clients (Display *disp, GHashTable *seen, /*{{{*/
+        unsigned long wid) {
+    /* look at the clients which appeared since the last scan and start
+     * watching their names, which may still change to match */
+    Window *client_list;
+    unsigned long client_list_size;
+    Window found = 0;
+    int i;
+
+    if ((client_list = get_client_list(disp, &client_list_size)) == NULL) {
+        return 0;
+    }
+
+    for (i = 0; i < client_list_size / sizeof(Window); i++) {
+        gpointer key = GUINT_TO_POINTER(client_list[i]);
+        if (g_hash_table_lookup(seen, key)) {
+            continue;
+        }
+        g_hash_table_insert(seen, key, key);
+        XSelectInput(disp, client_list[i], PropertyChangeMask);
+        if (window_matches_arg(disp, client_list[i], options.param_wait, wid)) {
+            found = client_list[i];
+            break;
+        }
+    }
+
+    g_free(client_list);
+    return found;
+}/*}}}*/
+
+static int wait_for_window (Display *disp, Window *win) {/*{{{*/
+    Window root = DefaultRootWindow(disp);
+    Atom xa_client_list = XInternAtom(disp, options.stacking_order ?
+            "_NET_CLIENT_LIST_STACKING" : "_NET_CLIENT_LIST", False);
+    Atom xa_win_client_list = XInternAtom(disp, "_WIN_CLIENT_LIST", False);
+    Atom xa_net_wm_name = XInternAtom(disp, "_NET_WM_NAME", False);
+    Atom xa_net_wm_state = XInternAtom(disp, "_NET_WM_STATE", False);
+    GHashTable *seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+    gint64 start = g_get_monotonic_time();
+    unsigned long wid = 0;
+    gboolean rescan = TRUE;
+    Window found = 0;
+    XEvent event;
+
+    if (options.match_by_id && ! parse_window_id(options.param_wait, &wid)) {
+        g_hash_table_destroy(seen);
+        return EXIT_FAILURE;
+    }
+
+    /* select the events before reading the client list, so that
+     * no change can slip in between */
+    XSelectInput(disp, root, PropertyChangeMask);
+
+    while (! found) {
+        if (rescan) {
+            rescan = FALSE;
+            if ((found = wait_scan_clients(disp, seen, wid))) {
+                break;
+            }
+        }
+
+        if (! next_event(disp, &event, -1)) {
+            if (timed_out) {
+                fprintf(stderr, "No matching window appeared within %ld ms.\n",
+                        options.timeout);
+            }
+            else if (interrupted) {
+                fputs("Interrupted before a matching window appeared.\n", stderr);
+            }
+            else {
+                fprintf(stderr, "Waiting for a matching window failed: %s\n",
+                        g_strerror(errno));
+            }
+            g_hash_table_destroy(seen);
+            return EXIT_FAILURE;
+        }
+        if (event.type != PropertyNotify) {
+            continue;
+        }
+
+        if (event.xproperty.window == root) {
+            if (event.xproperty.atom == xa_client_list ||
+                    event.xproperty.atom == xa_win_client_list) {
+                rescan = TRUE;
+            }
+        }
+        else if (((! options.match_by_id &&
+                        event.xproperty.state == PropertyNewValue &&
+                        (event.xproperty.atom == XA_WM_NAME ||
+                         event.xproperty.atom == xa_net_wm_name ||
+                         event.xproperty.atom == XA_WM_CLASS)) ||
+                    /* a deleted state may pass a --state filter too */
+                    (options.filter_state &&
+                     event.xproperty.atom == xa_net_wm_state)) &&
+                window_matches_arg(disp, event.xproperty.window,
+                    options.param_wait, wid)) {
+            found = event.xproperty.window;
+        }
+    }
+
+    printf("0x%.8lx %ld\n", found,
+            (long)((g_get_monotonic_time() - start) / 1000));
+
+    g_hash_table_destroy(seen);
+    *win = found;
+    return EXIT_SUCCESS;
+}/*}}}*/
+
+static int close_all_windows (Display *disp) {/*{{{*/
+    Window *client_list;
+    unsigned long client_list_size;
+    GHashTable *pending = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GHashTableIter iter;
+    gpointer key;
+    gint64 start = g_get_monotonic_time();
+    Atom xa_client_list = XInternAtom(disp, "_NET_CLIENT_LIST", False);
+    Atom xa_win_client_list = XInternAtom(disp, "_WIN_CLIENT_LIST", False);
+    unsigned long serial;
+    unsigned long wid = 0;
+    int matched, closed, killed = 0;
+    int i;
+    XEvent event;
+
+    if (options.match_by_id && ! parse_window_id(options.param_window, &wid)) {
+        g_hash_table_destroy(pending);
+        return EXIT_FAILURE;
+    }
+    if ((client_list = get_client_list(disp, &client_list_size)) == NULL) {
+        g_hash_table_destroy(pending);
+        return EXIT_FAILURE;
+    }
+
+    /* ask all the windows at once; each one is watched before its
+     * close request is sent, so that no notification can be missed */
+    XSelectInput(disp, DefaultRootWindow(disp), PropertyChangeMask);
+    serial = NextRequest(disp);
+    for (i = 0; i < client_list_size / sizeof(Window); i++) {
+        if (! window_matches_arg(disp, client_list[i], options.param_window, wid)) {
+            continue;
+        }
+        p_verbose("Closing window 0x%.8lx\n", client_list[i]);
+        XSelectInput(disp, client_list[i], StructureNotifyMask);
+        close_window(disp, client_list[i]);
+        g_hash_table_insert(pending, GSIZE_TO_POINTER(client_list[i]),
+                GSIZE_TO_POINTER(client_list[i]));
+    }
+    g_free(client_list);
+
+    if ((matched = g_hash_table_size(pending)) == 0) {
+        g_hash_table_destroy(pending);
+        return EXIT_FAILURE;
+    }
+
+    /* one round trip sends the requests and reports the windows
+     * which were gone already */
+    XSync(disp, False);
+    g_hash_table_iter_init(&iter, pending);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (window_vanished(GPOINTER_TO_SIZE(key), serial)) {
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+
+    /* A window counts as closed when it's destroyed or the window
+     * manager drops it from the client list. Being unmapped isn't
+     * enough, a minimized window or one which asks "save changes?"
+     * may be unmapped too. */
+    while (g_hash_table_size(pending) > 0 &&
+            next_event(disp, &event, start + options.grace * 1000)) {
+        if (event.type == DestroyNotify) {
+            g_hash_table_remove(pending, GSIZE_TO_POINTER(event.xdestroywindow.window));
+        }
+        else if (event.type == PropertyNotify &&
+                (event.xproperty.atom == xa_client_list ||
+                 event.xproperty.atom == xa_win_client_list)) {
+            GHashTable *current = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+            if ((client_list = get_client_list(disp, &client_list_size))) {
+                for (i = 0; i < client_list_size / sizeof(Window); i++) {
+                    g_hash_table_add(current, GSIZE_TO_POINTER(client_list[i]));
+                }
+                g_hash_table_iter_init(&iter, pending);
+                while (g_hash_table_iter_next(&iter, &key, NULL)) {
+                    if (! g_hash_table_contains(current, key)) {
+                        g_hash_table_iter_remove(&iter);
+                    }
+                }
+                g_free(client_list);
+            }
+            g_hash_table_destroy(current);
+        }
+    }
+    if (timed_out) {
+        g_hash_table_destroy(pending);
+        return EXIT_FAILURE;
+    }
+    closed = matched - g_hash_table_size(pending);
+
+    /* the survivors had their chance; a client may have exited
+     * meanwhile, then XKillClient() fails with BadValue */
+    serial = NextRequest(disp);
+    ignore_bad_value = TRUE;
+    g_hash_table_iter_init(&iter, pending);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        p_verbose("Killing the client of window 0x%.8lx\n",
+                (unsigned long)GPOINTER_TO_SIZE(key));
+        XKillClient(disp, GPOINTER_TO_SIZE(key));
+    }
+    XSync(disp, False);
+    ignore_bad_value = FALSE;
+    g_hash_table_iter_init(&iter, pending);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (window_vanished(GPOINTER_TO_SIZE(key), serial)) {
+            closed++;
+        }
+        else {
+            killed++;
+        }
+    }
+
+    printf("Closed %d of %d windows, killed the clients of %d in %ld ms.\n",
+            closed, matched, killed,
+            (long)((g_get_monotonic_time() - start) / 1000));
+
+    g_hash_table_destroy(pending);
+    return EXIT_SUCCESS;
+}/*}}}*/
+
+/* Aho-Corasick automaton over the bytes of the casefolded substring
+ * patterns of the rules, with a full transition table */
+typedef struct {
+    gint *next;         /* 256 transitions per state */
+    gint *fail;
+    gint *out;          /* first rule whose pattern ends in the state */
+    gint *dict;         /* nearest state on the fail chain with output */
+    gint n_states;
+    gint allocated;
+} ac_automaton;
+
+#define RULE_TITLE 0
+#define RULE_CLASS 1
+
+typedef struct {
+    int field;              /* RULE_TITLE or RULE_CLASS */
+    GRegex *regex;          /* NULL for substring rules */
+    match_pattern pattern;
+    char action;
+    gchar *arg;
+    gint next_same;         /* next rule ending in the same state */
+} rule;
+
+typedef struct {
+    GArray *rules;
+    ac_automaton ac[2];     /* indexed by the field */
+    gboolean has_regex[2];
+    gboolean uses_field[2];
+    gboolean netwm;         /* _NET_MOVERESIZE_WINDOW is supported */
+} rule_set;
+
+static gint ac_add_state (ac_automaton *ac) {/*{{{*/
+    gint s = ac->n_states++;
+    int c;
+
+    if (ac->n_states > ac->allocated) {
+        ac->allocated = ac->allocated ? ac->allocated * 2 : 64;
+        ac->next = g_renew(gint, ac->next, ac->allocated * 256);
+        ac->fail = g_renew(gint, ac->fail, ac->allocated);
+        ac->out = g_renew(gint, ac->out, ac->allocated);
+        ac->dict = g_renew(gint, ac->dict, ac->allocated);
+    }
+    for (c = 0; c < 256; c++) {
+        ac->next[s * 256 + c] = -1;
+    }
+    ac->fail[s] = 0;
+    ac->out[s] = -1;
+    ac->dict[s] = -1;
+
+    return s;
+}/*}}}*/
+
+static void ac_add (ac_automaton *ac, GArray *rules, gint rule_idx) {/*{{{*/
+    rule *r = &g_array_index(rules, rule, rule_idx);
+    const guchar *p = (const guchar *)r->pattern.casefold;
+    gint s = 0;
+
+    if (ac->n_states == 0) {
+        ac_add_state(ac);
+    }
+    for (; *p; p++) {
+        if (ac->next[s * 256 + *p] < 0) {
+            gint t = ac_add_state(ac);
+            ac->next[s * 256 + *p] = t;
+        }
+        s = ac->next[s * 256 + *p];
+    }
+    r->next_same = ac->out[s];
+    ac->out[s] = rule_idx;
+}/*}}}*/
+
+static void ac_build (ac_automaton *ac) {/*{{{*/
+    /* breadth first, so that the row of a fail state is complete
+     * by the time it's needed */
+    gint *queue;
+    gint head = 0, tail = 0;
+    int c;
+
+    if (ac->n_states == 0) {
+        return;
+    }
+
+    queue = g_new(gint, ac->n_states);
+    queue[tail++] = 0;
+    while (head < tail) {
+        gint u = queue[head++];
+        for (c = 0; c < 256; c++) {
+            gint v = ac->next[u * 256 + c];
+            gint f = (u == 0) ? 0 : ac->next[ac->fail[u] * 256 + c];
+            if (v < 0) {
+                ac->next[u * 256 + c] = f;
+                continue;
+            }
+            ac->fail[v] = f;
+            ac->dict[v] = ac->out[f] >= 0 ? f : ac->dict[f];
+            queue[tail++] = v;
+        }
+    }
+    g_free(queue);
+}/*}}}*/
+
+static void ac_scan (const ac_automaton *ac, GArray *rules, /*{{{*/
+        const gchar *text, gboolean fold_ascii, gboolean *matched) {
+    const guchar *p = (const guchar *)text;
+    gint s = 0;
+
+    if (ac->n_states == 0) {
+        return;
+    }
+    for (; *p; p++) {
+        gint t;
+        s = ac->next[s * 256 + (fold_ascii ? ascii_fold(*p) : *p)];
+        for (t = ac->out[s] >= 0 ? s : ac->dict[s]; t >= 0; t = ac->dict[t]) {
+            gint r;
+            for (r = ac->out[t]; r >= 0; r = g_array_index(rules, rule, r).next_same) {
+                matched[r] = TRUE;
+            }
+        }
+    }
+}/*}}}*/
+
+static void ac_free (ac_automaton *ac) {/*{{{*/
+    g_free(ac->next);
+    g_free(ac->fail);
+    g_free(ac->out);
+    g_free(ac->dict);
+}/*}}}*/
+
+static gboolean parse_rule (const char *file, int lineno, /*{{{*/
+        gchar *line, rule *r) {
+    gchar *arrow, *lhs, *rhs, *pattern;
+    GError *err = NULL;
+
+    memset(r, 0, sizeof(*r));
+
+    if (! (arrow = g_strrstr(line, "->"))) {
+        fprintf(stderr, "%s:%d: Missing \"->\".\n", file, lineno);
+        return FALSE;
+    }
+    *arrow = '\0';
+    lhs = g_strstrip(line);
+    rhs = g_strstrip(arrow + 2);
+
+    /* field */
+    if (strncmp(lhs, "title", 5) == 0) {
+        r->field = RULE_TITLE;
+        pattern = lhs + 5;
+    }
+    else if (strncmp(lhs, "class", 5) == 0) {
+        r->field = RULE_CLASS;
+        pattern = lhs + 5;
+    }
+    else {
+        fprintf(stderr, "%s:%d: The rule must start with \"title\" or \"class\".\n",
+                file, lineno);
+        return FALSE;
+    }
+    if (*pattern == '~') {
+        pattern++;
+        if (! (r->regex = g_regex_new(g_strchug(pattern),
+                        G_REGEX_CASELESS | G_REGEX_OPTIMIZE, 0, &err))) {
+            fprintf(stderr, "%s:%d: %s\n", file, lineno, err->message);
+            g_error_free(err);
+            return FALSE;
+        }
+    }
+    else if (*pattern != ' ' && *pattern != '\t' && *pattern != '\0') {
+        fprintf(stderr, "%s:%d: Unknown field \"%s\".\n", file, lineno, lhs);
+        return FALSE;
+    }
+    else if (*(pattern = g_strchug(pattern)) == '\0') {
+        fprintf(stderr, "%s:%d: Empty pattern.\n", file, lineno);
+        return FALSE;
+    }
+    else {
+        match_pattern_init(&r->pattern, pattern);
+    }
+
+    /* action */
+    r->action = rhs[0];
+    if (! r->action || ! strchr("acRYzEtebyNIT", r->action) ||
+            (rhs[1] != '\0' && rhs[1] != ' ' && rhs[1] != '\t')) {
+        fprintf(stderr, "%s:%d: Invalid action \"%s\".\n", file, lineno, rhs);
+        return FALSE;
+    }
+    if (rhs[1]) {
+        r->arg = g_strdup(g_strchug(rhs + 1));
+    }
+    if (strchr("tebyNIT", r->action) && (! r->arg || ! *r->arg)) {
+        fprintf(stderr, "%s:%d: The action \"%c\" needs an argument.\n",
+                file, lineno, r->action);
+        return FALSE;
+    }
+
+    return TRUE;
+}/*}}}*/
+
+static void rule_clear (rule *r) {/*{{{*/
+    if (r->regex) {
+        g_regex_unref(r->regex);
+    }
+    match_pattern_clear(&r->pattern);
+    g_free(r->arg);
+}/*}}}*/
+
+static void rule_set_free (rule_set *set) {/*{{{*/
+    int i;
+
+    for (i = 0; i < set->rules->len; i++) {
+        rule_clear(&g_array_index(set->rules, rule, i));
+    }
+    g_array_free(set->rules, TRUE);
+    ac_free(&set->ac[RULE_TITLE]);
+    ac_free(&set->ac[RULE_CLASS]);
+}/*}}}*/
+
+static gboolean rule_set_load (rule_set *set, const char *file) {/*{{{*/
+    gchar *contents;
+    gchar **lines;
+    GError *err = NULL;
+    gboolean ok = TRUE;
+    int i;
+
+    memset(set, 0, sizeof(*set));
+    set->rules = g_array_new(FALSE, TRUE, sizeof(rule));
+
+    if (! g_file_get_contents(file, &contents, NULL, &err)) {
+        fprintf(stderr, "%s\n", err->message);
+        g_error_free(err);
+        return FALSE;
+    }
+
+    lines = g_strsplit(contents, "\n", 0);
+    for (i = 0; lines[i] && ok; i++) {
+        gchar *line = g_strstrip(lines[i]);
+        rule r;
+
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        if ((ok = parse_rule(file, i + 1, line, &r))) {
+            g_array_append_val(set->rules, r);
+        }
+        else {
+            rule_clear(&r);
+        }
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    /* all the substring patterns of a field go to one automaton */
+    for (i = 0; ok && i < set->rules->len; i++) {
+        rule *r = &g_array_index(set->rules, rule, i);
+        set->uses_field[r->field] = TRUE;
+        if (r->regex) {
+            set->has_regex[r->field] = TRUE;
+        }
+        else {
+            ac_add(&set->ac[r->field], set->rules, i);
+        }
+    }
+    ac_build(&set->ac[RULE_TITLE]);
+    ac_build(&set->ac[RULE_CLASS]);
+
+    p_verbose("Loaded %u rules from %s.\n", set->rules->len, file);
+    return ok;
+}/*}}}*/
+
+static void rule_set_match_field (rule_set *set, int field, /*{{{*/
+        const gchar *str_utf8, gboolean *matched) {
+    int i;
+
+    if (str_is_ascii(str_utf8, strlen(str_utf8))) {
+        ac_scan(&set->ac[field], set->rules, str_utf8, TRUE, matched);
+    }
+    else {
+        gchar *str_cf = g_utf8_casefold(str_utf8, -1);
+        ac_scan(&set->ac[field], set->rules, str_cf, FALSE, matched);
+        g_free(str_cf);
+    }
+
+    for (i = 0; set->has_regex[field] && i < set->rules->len; i++) {
+        rule *r = &g_array_index(set->rules, rule, i);
+        if (r->regex && r->field == field &&
+                g_regex_match(r->regex, str_utf8, 0, NULL)) {
+            matched[i] = TRUE;
+        }
+    }
+}/*}}}*/
+
+static gboolean rule_set_match (Display *disp, rule_set *set, /*{{{*/
+        Window win, gboolean *matched) {
+    /* fetch the title and the class of the window once, find all
+     * the rules matching them; returns TRUE if there is any */
+    gboolean any = FALSE;
+    int i;
+
+    memset(matched, 0, set->rules->len * sizeof(gboolean));
+
+    if (! window_state_matches(disp, win)) {
+        return FALSE;
+    }
+
+    if (set->uses_field[RULE_TITLE]) {
+        gchar *title_utf8 = get_window_title(disp, win);
+        if (title_utf8) {
+            rule_set_match_field(set, RULE_TITLE, title_utf8, matched);
+        }
+        g_free(title_utf8);
+    }
+    if (set->uses_field[RULE_CLASS]) {
+        gchar *class_utf8 = get_window_class(disp, win);
+        if (class_utf8) {
+            rule_set_match_field(set, RULE_CLASS, class_utf8, matched);
+        }
+        g_free(class_utf8);
+    }
+
+    for (i = 0; i < set->rules->len; i++) {
+        any = any || matched[i];
+    }
+    return any;
+}/*}}}*/
+
+static int rule_set_apply (Display *disp, rule_set *set, /*{{{*/
+        Window win, const gboolean *matched) {
+    /* Run the actions of the matching rules in the order of the file.
+     * The placements (-t, -e, -b) are sent as client messages right
+     * away, without any round trip; the caller flushes them. */
+    gchar *param;
+    int ret = EXIT_SUCCESS;
+    int rv, i;
+
+    for (i = 0; i < set->rules->len; i++) {
+        rule *r = &g_array_index(set->rules, rule, i);
+        if (! matched[i]) {
+            continue;
+        }
+        p_verbose("Rule %d matches window 0x%.8lx.\n", i + 1, win);
+        /* some actions (-b) cut the argument up, so each window gets
+         * a copy */
+        param = g_strdup(r->arg);
+        switch (options.with_children ? 0 : r->action) {
+            case 't':
+                rv = client_msg(disp, win, "_NET_WM_DESKTOP",
+                        (unsigned long)atoi(param), 0, 0, 0, 0);
+                break;
+            case 'e':
+                rv = move_resize_window(disp, win, param, set->netwm);
+                break;
+            case 'b':
+                rv = window_state(disp, win, param);
+                break;
+            default:
+                /* action_window() takes the argument from the options */
+                options.param = param;
+                rv = action_window(disp, win, r->action);
+                options.param = NULL;
+        }
+        if (rv != EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
+        }
+        g_free(param);
+    }
+    return ret;
+}/*}}}*/
+
+typedef struct {
+    unsigned long count;
+    gint64 total;       /* microseconds */
+    gint64 max;
+} rule_stats;
+
+/* a new window the rules were applied to */
+typedef struct {
+    Window win;
+    gint64 created_at;      /* -1 if unknown */
+    gboolean *matched;      /* the rules which matched it */
+} placed_window;
+
+static void place_new_clients (Display *disp, rule_set *set, /*{{{*/
+        GHashTable *seen, GHashTable *created, rule_stats *stats,
+        gboolean *matched) {
+    Window *client_list;
+    unsigned long client_list_size;
+    GHashTable *current;
+    GHashTableIter iter;
+    GArray *placed;
+    gpointer key;
+    gint64 now;
+    int n_rules;
+    int i, j;
+
+    if ((client_list = get_client_list(disp, &client_list_size)) == NULL) {
+        return;
+    }
+
+    /* Forget the windows which left the client list. Under a
+     * reparenting WM their DestroyNotify goes to the frame, not to the
+     * root window, and their IDs may be reused. */
+    current = g_hash_table_new(g_direct_hash, g_direct_equal);
+    for (i = 0; i < client_list_size / sizeof(Window); i++) {
+        g_hash_table_add(current, GSIZE_TO_POINTER(client_list[i]));
+    }
+    g_hash_table_iter_init(&iter, seen);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (! g_hash_table_contains(current, key)) {
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+    g_hash_table_destroy(current);
+
+    /* the requests for all the new windows go out in one flush, the
+     * latencies are taken after it */
+    n_rules = set->rules->len;
+    placed = g_array_new(FALSE, FALSE, sizeof(placed_window));
+    for (i = 0; i < client_list_size / sizeof(Window); i++) {
+        placed_window p;
+        gint64 *since;
+
+        key = GSIZE_TO_POINTER(client_list[i]);
+        if (g_hash_table_lookup(seen, key)) {
+            continue;
+        }
+        g_hash_table_insert(seen, key, key);
+
+        /* windows created before the daemon started, or not as children
+         * of the root window, count from now; the creation time isn't
+         * needed any more once the window is managed */
+        since = g_hash_table_lookup(created, key);
+        p.win = client_list[i];
+        p.created_at = since ? *since : -1;
+        g_hash_table_remove(created, key);
+
+        if (! rule_set_match(disp, set, client_list[i], matched)) {
+            continue;
+        }
+        rule_set_apply(disp, set, client_list[i], matched);
+        p.matched = g_new(gboolean, n_rules + 1);
+        memcpy(p.matched, matched, n_rules * sizeof(gboolean));
+        g_array_append_val(placed, p);
+    }
+    XFlush(disp);
+    now = g_get_monotonic_time();
+
+    for (i = 0; i < placed->len; i++) {
+        placed_window *p = &g_array_index(placed, placed_window, i);
+        gint64 elapsed = p->created_at >= 0 ? now - p->created_at : 0;
+
+        for (j = 0; j < n_rules; j++) {
+            if (! p->matched[j]) {
+                continue;
+            }
+            stats[j].count++;
+            stats[j].total += elapsed;
+            stats[j].max = MAX(stats[j].max, elapsed);
+            printf("0x%.8lx rule %d %ld.%03ld ms\n", p->win, j + 1,
+                    (long)(elapsed / 1000), (long)(elapsed % 1000));
+        }
+        g_free(p->matched);
+    }
+    fflush(stdout);
+
+    g_array_free(placed, TRUE);
+    g_free(client_list);
+}/*}}}*/
+
+static int watch_rules (Display *disp, rule_set *set) {/*{{{*/
+    /* Place the new windows as soon as the window manager adds them to
+     * the client list. The time the window was created (CreateNotify on
+     * the root window) is remembered to measure the latency. */
+    Window root = DefaultRootWindow(disp);
+    Atom xa_client_list = XInternAtom(disp, options.stacking_order ?
+            "_NET_CLIENT_LIST_STACKING" : "_NET_CLIENT_LIST", False);
+    Atom xa_win_client_list = XInternAtom(disp, "_WIN_CLIENT_LIST", False);
+    GHashTable *seen = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GHashTable *created = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, g_free);
+    rule_stats *stats = g_new0(rule_stats, set->rules->len);
+    gboolean *matched = g_new(gboolean, set->rules->len + 1);
+    Window *client_list;
+    unsigned long client_list_size;
+    XEvent event;
+    int i;
+
+    init_interrupt_handler();
+    XSelectInput(disp, root, SubstructureNotifyMask | PropertyChangeMask);
+
+    /* the windows which exist already are left alone */
+    if ((client_list = get_client_list(disp, &client_list_size)) != NULL) {
+        for (i = 0; i < client_list_size / sizeof(Window); i++) {
+            g_hash_table_insert(seen, GSIZE_TO_POINTER(client_list[i]),
+                    GSIZE_TO_POINTER(client_list[i]));
+        }
+        g_free(client_list);
+    }
+
+    while (next_event(disp, &event, -1)) {
+        switch (event.type) {
+            case CreateNotify:
+                {
+                    gint64 *now = g_new(gint64, 1);
+                    *now = g_get_monotonic_time();
+                    g_hash_table_replace(created,
+                            GSIZE_TO_POINTER(event.xcreatewindow.window), now);
+                }
+                break;
+            case DestroyNotify:
+                g_hash_table_remove(created,
+                        GSIZE_TO_POINTER(event.xdestroywindow.window));
+                g_hash_table_remove(seen,
+                        GSIZE_TO_POINTER(event.xdestroywindow.window));
+                break;
+            case PropertyNotify:
+                if (event.xproperty.window == root &&
+                        (event.xproperty.atom == xa_client_list ||
+                         event.xproperty.atom == xa_win_client_list)) {
+                    place_new_clients(disp, set, seen, created, stats, matched);
+                }
+                break;
+        }
+    }
+
+    /* summary */
+    for (i = 0; i < set->rules->len; i++) {
+        if (stats[i].count) {
+            printf("rule %d: %lu windows, avg %.3f ms, max %.3f ms\n", i + 1,
+                    stats[i].count, stats[i].total / 1000.0 / stats[i].count,
+                    stats[i].max / 1000.0);
+        }
+        else {
+            printf("rule %d: 0 windows\n", i + 1);
+        }
+    }
+
+    g_free(matched);
+    g_free(stats);
+    g_hash_table_destroy(created);
+    g_hash_table_destroy(seen);
+    return timed_out ? EXIT_FAILURE : EXIT_SUCCESS;
+}/*}}}*/
+
+static int apply_rules (Display *disp) {/*{{{*/
+    Window *client_list;
+    unsigned long client_list_size;
+    rule_set set;
+    gboolean *matched;
+    int ret = EXIT_SUCCESS;
+    int i;
+
+    if (! rule_set_load(&set, options.param_rules)) {
+        rule_set_free(&set);
+        return EXIT_FAILURE;
+    }
+    /* checked once, not per placement */
+    set.netwm = wm_supports(disp, "_NET_MOVERESIZE_WINDOW");
+    if (! set.netwm) {
+        p_verbose("WM doesn't support _NET_MOVERESIZE_WINDOW. Gravity will be ignored.\n");
+    }
+    if (options.daemon) {
+        ret = watch_rules(disp, &set);
+        rule_set_free(&set);
+        return ret;
+    }
+    if ((client_list = get_client_list(disp, &client_list_size)) == NULL) {
+        rule_set_free(&set);
+        return EXIT_FAILURE;
+    }
+
+    matched = g_new(gboolean, set.rules->len + 1);
+    for (i = 0; i < client_list_size / sizeof(Window); i++) {
+        if (rule_set_match(disp, &set, client_list[i], matched) &&
+                rule_set_apply(disp, &set, client_list[i], matched) != EXIT_SUCCESS) {
+            ret = EXIT_FAILURE;
+        }
+    }
+
+    g_free(matched);
+    g_free(client_list);
+    rule_set_free(&set);
+    return ret;
+}/*}}}*/
+
+/* a key binding of --hotkeys */
+typedef struct {
+    gchar *keys;            /* as written in the file */
+    gchar *command;
+    KeyCode keycode;
+    unsigned int modifiers;
+    int action;
+    gchar *param_window;
+    gchar *param;
+    int match_by_id;
+    int match_by_cls;
+    int full_window_title_match;
+    gboolean grabbed;       /* FALSE if another client has the key */
+} hotkey;
+
+static const struct {
+    const char *name;
+    unsigned int mask;
+} hotkey_modifiers[] = {
+    {"shift", ShiftMask},
+    {"control", ControlMask},
+    {"ctrl", ControlMask},
+    {"alt", Mod1Mask},
+    {"mod1", Mod1Mask},
+    {"mod2", Mod2Mask},
+    {"mod3", Mod3Mask},
+    {"super", Mod4Mask},
+    {"mod4", Mod4Mask},
+    {"mod5", Mod5Mask},
+    {NULL, 0}
+};
+
+static void hotkey_clear (hotkey *h) {/*{{{*/
+    g_free(h->keys);
+    g_free(h->command);
+    g_free(h->param_window);
+    g_free(h->param);
+}/*}}}*/
+
+static gboolean parse_hotkey_keys (Display *disp, const char *file, /*{{{*/
+        int lineno, hotkey *h) {
+    /* [<MODIFIER>+]...<KEYSYM>, e.g. Super+Shift+Left */
+    gchar **parts = g_strsplit(h->keys, "+", 0);
+    guint n = g_strv_length(parts);
+    KeySym sym;
+    guint i, j;
+
+    for (i = 0; i + 1 < n; i++) {
+        gchar *name = g_ascii_strdown(g_strstrip(parts[i]), -1);
+        for (j = 0; hotkey_modifiers[j].name; j++) {
+            if (strcmp(name, hotkey_modifiers[j].name) == 0) {
+                h->modifiers |= hotkey_modifiers[j].mask;
+                break;
+            }
+        }
+        g_free(name);
+        if (! hotkey_modifiers[j].name) {
+            fprintf(stderr, "%s:%d: Unknown modifier \"%s\".\n",
+                    file, lineno, parts[i]);
+            g_strfreev(parts);
+            return FALSE;
+        }
+    }
+
+    if (n == 0 || (sym = XStringToKeysym(g_strstrip(parts[n - 1]))) == NoSymbol) {
+        fprintf(stderr, "%s:%d: Unknown key \"%s\".\n", file, lineno,
+                n ? parts[n - 1] : "");
+        g_strfreev(parts);
+        return FALSE;
+    }
+    if (! (h->keycode = XKeysymToKeycode(disp, sym))) {
+        fprintf(stderr, "%s:%d: There is no key for \"%s\" on the keyboard.\n",
+                file, lineno, parts[n - 1]);
+        g_strfreev(parts);
+        return FALSE;
+    }
+
+    g_strfreev(parts);
+    return TRUE;
+}/*}}}*/
+
+static gboolean parse_hotkey_command (const char *file, int lineno, /*{{{*/
+        hotkey *h) {
+    /* The command is a wmctrl command line like in the key bindings
+     * of other programs. Only the actions which take at most a window
+     * and an argument are allowed, with the options -i, -x and -F. */
+    gchar **argv = NULL;
+    GError *err = NULL;
+    int argc, i;
+
+    if (! g_shell_parse_argv(h->command, &argc, &argv, &err)) {
+        fprintf(stderr, "%s:%d: %s\n", file, lineno, err->message);
+        g_error_free(err);
+        return FALSE;
+    }
+
+    for (i = strcmp(argv[0], "wmctrl") == 0 ? 1 : 0; i < argc; i++) {
+        const char *opt = argv[i];
+        const char *spec;
+        gchar *arg = NULL;
+        int j;
+
+        if (opt[0] != '-' || opt[1] == '\0') {
+            fprintf(stderr, "%s:%d: Unexpected argument \"%s\".\n",
+                    file, lineno, opt);
+            g_strfreev(argv);
+            return FALSE;
+        }
+        for (j = 1; opt[j]; j++) {
+            char c = opt[j];
+
+            if (c == ':' || ! (spec = strchr(SHORT_OPTIONS, c))) {
+                fprintf(stderr, "%s:%d: Unknown option \"-%c\".\n",
+                        file, lineno, c);
+                g_strfreev(argv);
+                return FALSE;
+            }
+            if (spec[1] == ':') {
+                if (opt[j + 1]) {
+                    arg = g_strdup(opt + j + 1);
+                }
+                else if (i + 1 < argc) {
+                    arg = g_strdup(argv[++i]);
+                }
+                else {
+                    fprintf(stderr, "%s:%d: The option \"-%c\" needs an argument.\n",
+                            file, lineno, c);
+                    g_strfreev(argv);
+                    return FALSE;
+                }
+            }
+
+            switch (c) {
+                case 'F':
+                    h->full_window_title_match = 1;
+                    break;
+                case 'i':
+                    h->match_by_id = 1;
+                    break;
+                case 'x':
+                    h->match_by_cls = 1;
+                    break;
+                case 'a': case 'c': case 'R': case 'z': case 'Y': case 'E':
+                    g_free(h->param_window);
+                    h->param_window = arg;
+                    h->action = c;
+                    break;
+                case 'r':
+                    g_free(h->param_window);
+                    h->param_window = arg;
+                    break;
+                case 't': case 'e': case 'b': case 'N': case 'I': case 'T':
+                case 'y': case 's': case 'k': case 'o': case 'n': case 'g':
+                    g_free(h->param);
+                    h->param = arg;
+                    h->action = c;
+                    break;
+                default:
+                    fprintf(stderr, "%s:%d: The option \"-%c\" can't be bound "
+                            "to a key.\n", file, lineno, c);
+                    g_free(arg);
+                    g_strfreev(argv);
+                    return FALSE;
+            }
+            if (arg) {
+                break;  /* the rest of the word was the argument */
+            }
+        }
+    }
+    g_strfreev(argv);
+
+    if (! h->action) {
+        fprintf(stderr, "%s:%d: No action.\n", file, lineno);
+        return FALSE;
+    }
+    if (strchr("acRzYEtebNITy", h->action) && ! h->param_window) {
+        fprintf(stderr, "%s:%d: No window was specified.\n", file, lineno);
+        return FALSE;
+    }
+    return TRUE;
+}/*}}}*/
+
+static GArray *load_hotkeys (Display *disp, const char *file) {/*{{{*/
+    /* <KEYS> -> <COMMAND>, one per line, # starts a comment */
+    GArray *hotkeys = g_array_new(FALSE, TRUE, sizeof(hotkey));
+    gchar *contents;
+    gchar **lines;
+    GError *err = NULL;
+    gboolean ok = TRUE;
+    int i, j;
+
+    if (! g_file_get_contents(file, &contents, NULL, &err)) {
+        fprintf(stderr, "%s\n", err->message);
+        g_error_free(err);
+        g_array_free(hotkeys, TRUE);
+        return NULL;
+    }
+
+    lines = g_strsplit(contents, "\n", 0);
+    for (i = 0; lines[i] && ok; i++) {
+        gchar *line = g_strstrip(lines[i]);
+        gchar *arrow;
+        hotkey h;
+
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        memset(&h, 0, sizeof(h));
+        if (! (arrow = strstr(line, "->"))) {
+            fprintf(stderr, "%s:%d: Missing \"->\".\n", file, i + 1);
+            ok = FALSE;
+            break;
+        }
+        *arrow = '\0';
+        h.keys = g_strdup(g_strstrip(line));
+        h.command = g_strdup(g_strstrip(arrow + 2));
+
+        ok = parse_hotkey_keys(disp, file, i + 1, &h) &&
+                parse_hotkey_command(file, i + 1, &h);
+        for (j = 0; ok && j < hotkeys->len; j++) {
+            hotkey *other = &g_array_index(hotkeys, hotkey, j);
+            if (other->keycode == h.keycode && other->modifiers == h.modifiers) {
+                fprintf(stderr, "%s:%d: \"%s\" is bound already.\n",
+                        file, i + 1, h.keys);
+                ok = FALSE;
+            }
+        }
+        if (ok) {
+            g_array_append_val(hotkeys, h);
+        }
+        else {
+            hotkey_clear(&h);
+        }
+    }
+    g_strfreev(lines);
+    g_free(contents);
+
+    if (! ok) {
+        for (i = 0; i < hotkeys->len; i++) {
+            hotkey_clear(&g_array_index(hotkeys, hotkey, i));
+        }
+        g_array_free(hotkeys, TRUE);
+        return NULL;
+    }
+    p_verbose("Loaded %u hotkeys from %s.\n", hotkeys->len, file);
+    return hotkeys;
+}/*}}}*/
+
+static unsigned int num_lock_mask (Display *disp) {/*{{{*/
+    XModifierKeymap *map = XGetModifierMapping(disp);
+    KeyCode num_lock = XKeysymToKeycode(disp, XK_Num_Lock);
+    unsigned int mask = 0;
+    int i;
+
+    for (i = 0; num_lock && i < 8 * map->max_keypermod; i++) {
+        if (map->modifiermap[i] == num_lock) {
+            mask = 1 << (i / map->max_keypermod);
+        }
+    }
+    XFreeModifiermap(map);
+    return mask;
+}/*}}}*/
+
+static int run_hotkey (Display *disp, hotkey *h) {/*{{{*/
+    /* The actions take their arguments from the options. Some of them
+     * (-b) cut the argument up, so they get a copy each time. */
+    gchar *param = g_strdup(h->param);
+    int ret;
+
+    options.param_window = h->param_window;
+    options.param = param;
+    options.match_by_id = h->match_by_id;
+    options.match_by_cls = h->match_by_cls;
+    options.show_class = h->match_by_cls;
+    options.full_window_title_match = h->full_window_title_match;
+
+    switch (h->action) {
+        case 's':
+            ret = switch_desktop(disp);
+            break;
+        case 'k':
+            ret = showing_desktop(disp);
+            break;
+        case 'o':
+            ret = change_viewport(disp);
+            break;
+        case 'n':
+            ret = change_number_of_desktops(disp);
+            break;
+        case 'g':
+            ret = change_geometry(disp);
+            break;
+        default:
+            if (options.match_by_id) {
+                ret = action_window_pid(disp, h->action);
+            }
+            else {
+                ret = action_window_str(disp, h->action);
+            }
+    }
+
+    options.param = NULL;
+    g_free(param);
+    return ret;
+}/*}}}*/
+
+static int watch_hotkeys (Display *disp) {/*{{{*/
+    /* Grab the keys on the root window and run their commands on this
+     * connection. The time from reading the KeyPress event until the
+     * requests are flushed is printed for each key, and a summary per
+     * key on exit. The keys are also grabbed with Caps Lock and Num
+     * Lock, which don't change the binding. A key which another client
+     * has grabbed already is skipped, the others still work. */
+    Window root = DefaultRootWindow(disp);
+    GArray *hotkeys;
+    rule_stats *stats;
+    unsigned int lock_masks[4];
+    unsigned int ignored;
+    XEvent event;
+    int ret = EXIT_SUCCESS;
+    int n_grabbed = 0;
+    int i, j;
+
+    if (! (hotkeys = load_hotkeys(disp, options.param_hotkeys))) {
+        return EXIT_FAILURE;
+    }
+    stats = g_new0(rule_stats, hotkeys->len + 1);
+
+    lock_masks[0] = 0;
+    lock_masks[1] = LockMask;
+    lock_masks[2] = num_lock_mask(disp);
+    lock_masks[3] = LockMask | lock_masks[2];
+    ignored = lock_masks[3];
+
+    /* another client holding a grab is reported with BadAccess */
+    ignore_bad_access = TRUE;
+    for (i = 0; i < hotkeys->len; i++) {
+        hotkey *h = &g_array_index(hotkeys, hotkey, i);
+
+        bad_access = FALSE;
+        for (j = 0; j < 4; j++) {
+            if (j < 2 || lock_masks[2]) {
+                XGrabKey(disp, h->keycode, h->modifiers | lock_masks[j], root,
+                        False, GrabModeAsync, GrabModeAsync);
+            }
+        }
+        XSync(disp, False);
+        if (bad_access) {
+            fprintf(stderr, "%s is grabbed by another client already, "
+                    "skipping it.\n", h->keys);
+            /* release the lock variants which did succeed */
+            for (j = 0; j < 4; j++) {
+                XUngrabKey(disp, h->keycode, h->modifiers | lock_masks[j], root);
+            }
+            ret = EXIT_FAILURE;
+        }
+        else {
+            h->grabbed = TRUE;
+            n_grabbed++;
+        }
+    }
+    XSync(disp, False);
+    ignore_bad_access = FALSE;
+
+    if (n_grabbed == 0) {
+        fputs("None of the keys could be grabbed.\n", stderr);
+    }
+
+    init_interrupt_handler();
+    while (n_grabbed > 0 && next_event(disp, &event, -1)) {
+        gint64 start, elapsed;
+
+        if (event.type != KeyPress) {
+            continue;
+        }
+        start = g_get_monotonic_time();
+        for (i = 0; i < hotkeys->len; i++) {
+            hotkey *h = &g_array_index(hotkeys, hotkey, i);
+            if (h->grabbed && h->keycode == event.xkey.keycode &&
+                    h->modifiers == (event.xkey.state & ~ignored & 0xff)) {
+                break;
+            }
+        }
+        if (i == hotkeys->len) {
+            continue;
+        }
+
+        run_hotkey(disp, &g_array_index(hotkeys, hotkey, i));
+        XFlush(disp);
+        elapsed = g_get_monotonic_time() - start;
+
+        stats[i].count++;
+        stats[i].total += elapsed;
+        stats[i].max = MAX(stats[i].max, elapsed);
+        printf("%s %ld.%03ld ms\n", g_array_index(hotkeys, hotkey, i).keys,
+                (long)(elapsed / 1000), (long)(elapsed % 1000));
+        fflush(stdout);
+    }
+
+    /* summary */
+    for (i = 0; n_grabbed > 0 && i < hotkeys->len; i++) {
+        hotkey *h = &g_array_index(hotkeys, hotkey, i);
+        if (! h->grabbed) {
+            printf("%s: not grabbed, another client has it\n", h->keys);
+        }
+        else if (stats[i].count) {
+            printf("%s: %lu times, avg %.3f ms, max %.3f ms\n", h->keys,
+                    stats[i].count, stats[i].total / 1000.0 / stats[i].count,
+                    stats[i].max / 1000.0);
+        }
+        else {
+            printf("%s: 0 times\n", h->keys);
+        }
+    }
+
+    for (i = 0; i < hotkeys->len; i++) {
+        hotkey_clear(&g_array_index(hotkeys, hotkey, i));
+    }
+    g_array_free(hotkeys, TRUE);
+    g_free(stats);
+    return timed_out ? EXIT_FAILURE : ret;
+}/*}}}*/
+
+#define MAX_ICON_SIZE 4096
+#define EXIT_NO_ICON 2      /* save_icon(): the window has no icon */
+
+static gboolean icon_is_better (unsigned long w, unsigned long h, /*{{{*/
+        unsigned long best_w, unsigned long best_h) {
+    /* the smallest icon reaching --size, or the largest one */
+    unsigned long size = MAX(w, h);
+    unsigned long best = MAX(best_w, best_h);
+    gboolean fits = options.icon_size > 0 && size >= options.icon_size;
+    gboolean best_fits = options.icon_size > 0 && best >= options.icon_size;
+
+    if (best == 0 || fits != best_fits) {
+        return best == 0 || fits;
+    }
+    return fits ? size < best : size > best;
+}/*}}}*/
+
+/* an icon to find and save, see save_icons() */
+typedef struct {
+    Window win;
+    const char *file;
+    long pos;               /* the next header, in 32-bit units */
+    long offset;            /* the pixels of the chosen icon */
+    unsigned long width, height;
+    gboolean scanning;
+    int ret;
+} icon_job;
+
+#define ICON_BATCH 16       /* windows per burst of --icons-all */
+
+static void find_icons (Display *disp, icon_job *jobs, int n) {/*{{{*/
+    /* The property is a list of <width> <height> <pixels...> entries and
+     * is often hundreds of kilobytes long. Only the headers are read
+     * here, the pixels of the chosen icons are read afterwards. The
+     * windows are scanned in lockstep: the requests for the next header
+     * of every window go out through XCB in one burst, so a round trip
+     * is needed per icon of the window with the most icons. */
+    xcb_connection_t *conn = XGetXCBConnection(disp);
+    Atom xa_icon = XInternAtom(disp, "_NET_WM_ICON", False);
+    xcb_get_property_cookie_t *cookies = g_new(xcb_get_property_cookie_t, n + 1);
+    gboolean scanning = TRUE;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        jobs[i].pos = jobs[i].offset = 0;
+        jobs[i].width = jobs[i].height = 0;
+        jobs[i].scanning = TRUE;
+    }
+
+    while (scanning) {
+        scanning = FALSE;
+        for (i = 0; i < n; i++) {
+            if (jobs[i].scanning) {
+                cookies[i] = xcb_get_property(conn, 0, jobs[i].win, xa_icon,
+                        XA_CARDINAL, jobs[i].pos, 2);
+            }
+        }
+        for (i = 0; i < n; i++) {
+            icon_job *job = &jobs[i];
+            xcb_get_property_reply_t *header;
+            unsigned long w = 0, h = 0, bytes_after = 0;
+
+            if (! job->scanning) {
+                continue;
+            }
+            if ((header = xcb_get_property_reply(conn, cookies[i], NULL))) {
+                if (header->type == XA_CARDINAL && header->format == 32 &&
+                        header->value_len == 2) {
+                    const guint32 *v = xcb_get_property_value(header);
+                    w = v[0];
+                    h = v[1];
+                }
+                bytes_after = header->bytes_after;
+                free(header);
+            }
+
+            job->scanning = FALSE;
+            if (w == 0 || h == 0 || w > MAX_ICON_SIZE || h > MAX_ICON_SIZE ||
+                    bytes_after < w * h * 4) {
+                continue;
+            }
+            if (icon_is_better(w, h, job->width, job->height)) {
+                job->width = w;
+                job->height = h;
+                job->offset = job->pos + 2;
+            }
+            if (bytes_after > w * h * 4) {
+                job->pos += 2 + w * h;
+                job->scanning = scanning = TRUE;
+            }
+        }
+    }
+    g_free(cookies);
+}/*}}}*/
+
+static void argb_to_rgba (const guint32 *argb, guchar *rgba, gsize n) {/*{{{*/
+    /* Each pixel is a 0xAARRGGBB cardinal. In memory order RGBA is
+     * 0xAABBGGRR as a little endian 32-bit value, i.e. the R and B
+     * bytes are swapped. */
+    gsize i = 0;
+
+#if defined(__SSE2__) && G_BYTE_ORDER == G_LITTLE_ENDIAN
+    const __m128i ag = _mm_set1_epi32(0xff00ff00);
+    const __m128i low = _mm_set1_epi32(0xff);
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(argb + i));
+        v = _mm_or_si128(_mm_and_si128(v, ag),
+                _mm_or_si128(_mm_and_si128(_mm_srli_epi32(v, 16), low),
+                    _mm_slli_epi32(_mm_and_si128(v, low), 16)));
+        _mm_storeu_si128((__m128i *)(rgba + i * 4), v);
+    }
+#endif
+
+    for (; i < n; i++) {
+        rgba[i * 4] = (argb[i] >> 16) & 0xff;
+        rgba[i * 4 + 1] = (argb[i] >> 8) & 0xff;
+        rgba[i * 4 + 2] = argb[i] & 0xff;
+        rgba[i * 4 + 3] = (argb[i] >> 24) & 0xff;
+    }
+}/*}}}*/
+
+static void put_be32 (guchar *p, guint32 v) {/*{{{*/
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}/*}}}*/
+
+static guint32 crc32_update (guint32 crc, const guchar *p, gsize len) {/*{{{*/
+    static guint32 table[256];
+    gsize i;
+
+    if (! table[1]) {
+        guint32 c, n, k;
+        for (n = 0; n < 256; n++) {
+            for (c = n, k = 0; k < 8; k++) {
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            table[n] = c;
+        }
+    }
+
+    crc = ~crc;
+    for (i = 0; i < len; i++) {
+        crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}/*}}}*/
+
+static void png_chunk (FILE *f, const char *type, /*{{{*/
+        const guchar *data, gsize len) {
+    guchar buf[4];
+    guint32 crc;
+
+    put_be32(buf, len);
+    fwrite(buf, 1, 4, f);
+    fwrite(type, 1, 4, f);
+    fwrite(data, 1, len, f);
+    crc = crc32_update(crc32_update(0, (const guchar *)type, 4), data, len);
+    put_be32(buf, crc);
+    fwrite(buf, 1, 4, f);
+}/*}}}*/
+
+static void write_png (FILE *f, const guchar *rgba, /*{{{*/
+        unsigned long w, unsigned long h) {
+    /* There's no zlib dependency, so the image data is stored in
+     * uncompressed deflate blocks. Icons are small enough. */
+    gsize raw_len = h * (1 + w * 4);
+    gsize n_blocks = (raw_len + 65534) / 65535;
+    gsize idat_len = 2 + raw_len + n_blocks * 5 + 4;
+    guchar *idat = g_malloc(idat_len);
+    guchar *raw = g_malloc(raw_len);
+    guchar ihdr[13];
+    guint32 s1 = 1, s2 = 0;
+    gsize i, pos = 0;
+
+    for (i = 0; i < h; i++) {
+        raw[i * (1 + w * 4)] = 0; /* no filter */
+        memcpy(raw + i * (1 + w * 4) + 1, rgba + i * w * 4, w * 4);
+    }
+
+    idat[pos++] = 0x78;
+    idat[pos++] = 0x01;
+    for (i = 0; i < raw_len; i += 65535) {
+        gsize len = MIN(65535, raw_len - i);
+        idat[pos++] = (i + len == raw_len);   /* BFINAL, stored */
+        idat[pos++] = len & 0xff;
+        idat[pos++] = len >> 8;
+        idat[pos++] = ~len & 0xff;
+        idat[pos++] = (~len >> 8) & 0xff;
+        memcpy(idat + pos, raw + i, len);
+        pos += len;
+    }
+    for (i = 0; i < raw_len; i++) {
+        s1 = (s1 + raw[i]) % 65521;
+        s2 = (s2 + s1) % 65521;
+    }
+    put_be32(idat + pos, (s2 << 16) | s1);
+
+    put_be32(ihdr, w);
+    put_be32(ihdr + 4, h);
+    ihdr[8] = 8;    /* bit depth */
+    ihdr[9] = 6;    /* RGBA */
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+
+    fwrite("\211PNG\r\n\032\n", 1, 8, f);
+    png_chunk(f, "IHDR", ihdr, sizeof(ihdr));
+    png_chunk(f, "IDAT", idat, idat_len);
+    png_chunk(f, "IEND", NULL, 0);
+
+    g_free(raw);
+    g_free(idat);
+}/*}}}*/
+
+static void write_pam (FILE *f, const guchar *rgba, /*{{{*/
+        unsigned long w, unsigned long h) {
+    fprintf(f, "P7\nWIDTH %lu\nHEIGHT %lu\nDEPTH 4\nMAXVAL 255\n"
+            "TUPLTYPE RGB_ALPHA\nENDHDR\n", w, h);
+    fwrite(rgba, 1, w * h * 4, f);
+}/*}}}*/
+
+static void save_icons (Display *disp, icon_job *jobs, int n) {/*{{{*/
+    /* Save the icons of the windows, with the pixels of all of them
+     * fetched in one burst after find_icons(). The result of each job
+     * is EXIT_SUCCESS, EXIT_FAILURE or EXIT_NO_ICON. */
+    xcb_connection_t *conn = XGetXCBConnection(disp);
+    Atom xa_icon = XInternAtom(disp, "_NET_WM_ICON", False);
+    xcb_get_property_cookie_t *cookies = g_new(xcb_get_property_cookie_t, n + 1);
+    int i;
+
+    find_icons(disp, jobs, n);
+    for (i = 0; i < n; i++) {
+        if (jobs[i].width) {
+            cookies[i] = xcb_get_property(conn, 0, jobs[i].win, xa_icon,
+                    XA_CARDINAL, jobs[i].offset, jobs[i].width * jobs[i].height);
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        icon_job *job = &jobs[i];
+        unsigned long pixels = job->width * job->height;
+        xcb_get_property_reply_t *reply;
+        guchar *rgba;
+        FILE *f;
+
+        if (! job->width) {
+            fprintf(stderr, "Window 0x%.8lx has no icon.\n", job->win);
+            job->ret = EXIT_NO_ICON;
+            continue;
+        }
+        reply = xcb_get_property_reply(conn, cookies[i], NULL);
+        if (! reply || reply->type != XA_CARDINAL || reply->format != 32 ||
+                reply->value_len != pixels) {
+            fprintf(stderr, "Cannot get the icon of window 0x%.8lx.\n", job->win);
+            free(reply);
+            job->ret = EXIT_FAILURE;
+            continue;
+        }
+
+        /* converted straight from the reply */
+        rgba = g_malloc(pixels * 4);
+        argb_to_rgba(xcb_get_property_value(reply), rgba, pixels);
+        free(reply);
+
+        job->ret = EXIT_SUCCESS;
+        if (! (f = fopen(job->file, "wb"))) {
+            perror(job->file);
+            job->ret = EXIT_FAILURE;
+        }
+        else {
+            if (g_str_has_suffix(job->file, ".pam")) {
+                write_pam(f, rgba, job->width, job->height);
+            }
+            else {
+                write_png(f, rgba, job->width, job->height);
+            }
+            if (fclose(f) != 0) {
+                perror(job->file);
+                job->ret = EXIT_FAILURE;
+            }
+            else {
+                printf("0x%.8lx %lux%lu %s\n", job->win, job->width,
+                        job->height, job->file);
+            }
+        }
+        g_free(rgba);
+    }
+    g_free(cookies);
+}/*}}}*/
+
+static int save_icon (Display *disp, Window win, const char *file) {/*{{{*/
+    icon_job job = { win, file };
+
+    save_icons(disp, &job, 1);
+    return job.ret;
+}/*}}}*/
+
+static int save_all_icons (Display *disp) {/*{{{*/
+    /* ICON_BATCH windows at a time; the windows without an icon are
+     * reported, but they aren't errors */
+    Window *client_list;
+    unsigned long client_list_size;
+    icon_job jobs[ICON_BATCH];
+    int ret = EXIT_SUCCESS;
+    int i, k, n;
+
+    if ((client_list = get_client_list(disp, &client_list_size)) == NULL) {
+        return EXIT_FAILURE;
+    }
+    n = filter_windows_by_state(disp, client_list,
+            client_list_size / sizeof(Window));
+
+    for (i = 0; i < n; i += ICON_BATCH) {
+        int count = MIN(n - i, ICON_BATCH);
+
+        for (k = 0; k < count; k++) {
+            gchar *name = g_strdup_printf("0x%.8lx.png", client_list[i + k]);
+            jobs[k].win = client_list[i + k];
+            jobs[k].file = g_build_filename(options.param_out, name, NULL);
+            g_free(name);
+        }
+        save_icons(disp, jobs, count);
+        for (k = 0; k < count; k++) {
+            if (jobs[k].ret == EXIT_FAILURE) {
+                ret = EXIT_FAILURE;
+            }
+            g_free((gchar *)jobs[k].file);
+        }
+    }
+
+    g_free(client_list);
+    return ret;
+}/*}}}*/
+
+/* The journal file is a header followed by a ring of fixed-size
+ * records. The titles are interned in <file>.titles, a ring of
+ * fixed-size slots of NUL terminated UTF-8, a record refers to its
+ * title by the slot number. */
+#define JOURNAL_MAGIC "WMCTRLJ2"
+#define DEFAULT_JOURNAL_RECORDS 65536
+#define JOURNAL_NO_TITLE 0xffffffffU
+#define JOURNAL_TITLE_SIZE 128      /* bytes per title slot */
+
+enum {
+    JOURNAL_NEW = 1,    /* added to the client list */
+    JOURNAL_GONE,       /* removed from the client list */
+    JOURNAL_FOCUS,      /* became the active window */
+    JOURNAL_DESKTOP,    /* the current desktop changed, window is 0 */
+    JOURNAL_TITLE,      /* the title changed */
+    JOURNAL_MOVE,       /* moved to another desktop */
+    JOURNAL_STATE,      /* _NET_WM_STATE changed */
+    JOURNAL_EVENT_COUNT
+};
+
+static const char *journal_event_names[JOURNAL_EVENT_COUNT] = {
+    "?", "new", "gone", "focus", "desktop", "title", "move", "state"
+};
+
+typedef struct {
+    char magic[8];
+    guint32 record_size;
+    guint32 capacity;       /* records in the ring */
+    guint64 written;        /* records ever written, the next one goes
+                               to written % capacity */
+    guint64 titles_written; /* title slots ever filled, the next one is
+                               titles_written % (2 * capacity) */
+    guint8 reserved[32];
+} journal_header;
+
+typedef struct {
+    guint64 time;           /* monotonic microseconds */
+    guint32 window;
+    guint32 title;          /* slot in the title file */
+    gint32 desktop;         /* -1 for all desktops or unknown */
+    guint32 type;
+} journal_record;
+
+/* The titles are kept in a ring of fixed-size slots in FILE.titles,
+ * twice as many as there are records. A slot is refilled when the title
+ * in it is more than a ring of records old, so a slot is reused only
+ * after all the records which refer to it have been overwritten. */
+typedef struct {
+    journal_header *header;
+    journal_record *records;
+    size_t map_size;
+    gchar *titles;
+    size_t titles_map_size;
+    guint64 *title_seq;     /* titles_written when each slot was filled */
+    GHashTable *title_ids;  /* title -> slot + 1 */
+} journal;
+
+/* what is known about a client window while recording */
+typedef struct {
+    gint32 desktop;
+    guint32 title;
+    gchar *title_str;       /* to refill the slot when it gets old */
+} journal_window;
+
+static gboolean journal_map (journal *j, const char *file, /*{{{*/
+        gboolean writable, guint32 capacity) {
+    /* map the journal, a new one is created with the given capacity */
+    journal_header header;
+    struct stat st;
+    int fd;
+
+    memset(j, 0, sizeof(*j));
+    if ((fd = open(file, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644)) < 0 ||
+            fstat(fd, &st) != 0) {
+        fprintf(stderr, "Cannot open %s: %s\n", file, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return FALSE;
+    }
+
+    if (st.st_size == 0 && writable) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+        header.record_size = sizeof(journal_record);
+        header.capacity = capacity;
+        st.st_size = sizeof(header) + (off_t)capacity * sizeof(journal_record);
+        if (ftruncate(fd, st.st_size) != 0 ||
+                pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+            fprintf(stderr, "Cannot create %s: %s\n", file, strerror(errno));
+            close(fd);
+            return FALSE;
+        }
+    }
+    else if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+            memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0 ||
+            header.record_size != sizeof(journal_record) ||
+            header.capacity == 0 || st.st_size != sizeof(header) +
+                (off_t)header.capacity * sizeof(journal_record)) {
+        fprintf(stderr, "%s is not a wmctrl journal.\n", file);
+        close(fd);
+        return FALSE;
+    }
+    else if (writable && header.capacity != capacity) {
+        p_verbose("%s keeps its size of %u records.\n", file, header.capacity);
+    }
+
+    j->map_size = st.st_size;
+    j->header = mmap(NULL, j->map_size, PROT_READ | (writable ? PROT_WRITE : 0),
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (j->header == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s: %s\n", file, strerror(errno));
+        j->header = NULL;
+        return FALSE;
+    }
+    j->records = (journal_record *)(j->header + 1);
+    return TRUE;
+}/*}}}*/
+
+static gchar *journal_map_titles (const char *file, guint32 capacity, /*{{{*/
+        gboolean writable, size_t *size) {
+    /* map FILE.titles, a writable one is created or resized to fit */
+    gchar *titles_file = g_strconcat(file, ".titles", NULL);
+    gchar *titles;
+    struct stat st;
+    int fd;
+
+    *size = (size_t)capacity * 2 * JOURNAL_TITLE_SIZE;
+    if ((fd = open(titles_file, writable ? O_RDWR | O_CREAT : O_RDONLY,
+                    0644)) < 0 || fstat(fd, &st) != 0) {
+        /* a journal without titles can still be read */
+        if (writable) {
+            fprintf(stderr, "Cannot open %s: %s\n", titles_file, strerror(errno));
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        g_free(titles_file);
+        return NULL;
+    }
+    if (st.st_size != *size && (! writable || ftruncate(fd, *size) != 0)) {
+        fprintf(stderr, "%s doesn't fit the journal.\n", titles_file);
+        close(fd);
+        g_free(titles_file);
+        return NULL;
+    }
+    titles = mmap(NULL, *size, PROT_READ | (writable ? PROT_WRITE : 0),
+            MAP_SHARED, fd, 0);
+    close(fd);
+    if (titles == MAP_FAILED) {
+        fprintf(stderr, "Cannot map %s: %s\n", titles_file, strerror(errno));
+        titles = NULL;
+    }
+    g_free(titles_file);
+    return titles;
+}/*}}}*/
+
+static gboolean journal_open (journal *j, const char *file, /*{{{*/
+        guint32 capacity) {
+    /* map the journal and its titles for writing */
+    if (! journal_map(j, file, TRUE, capacity) ||
+            ! (j->titles = journal_map_titles(file, j->header->capacity, TRUE,
+                    &j->titles_map_size))) {
+        return FALSE;
+    }
+    /* the slots filled before are known only to their records */
+    j->title_seq = g_new0(guint64, (gsize)j->header->capacity * 2);
+    j->title_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    return TRUE;
+}/*}}}*/
+
+static void journal_close (journal *j) {/*{{{*/
+    if (j->header) {
+        munmap(j->header, j->map_size);
+    }
+    if (j->titles) {
+        munmap(j->titles, j->titles_map_size);
+    }
+    if (j->title_ids) {
+        g_hash_table_destroy(j->title_ids);
+    }
+    g_free(j->title_seq);
+    memset(j, 0, sizeof(*j));
+}/*}}}*/
+
+static gboolean journal_title_stale (journal *j, guint32 id) {/*{{{*/
+    /* older than a ring of records, the slot may be reused soon */
+    return j->header->titles_written - j->title_seq[id] > j->header->capacity;
+}/*}}}*/
+
+static guint32 journal_title_id (journal *j, const gchar *title) {/*{{{*/
+    guint32 slots = j->header->capacity * 2;
+    guint32 id;
+    gchar *key, *slot;
+    gpointer old;
+    size_t len;
+
+    if (! title) {
+        return JOURNAL_NO_TITLE;
+    }
+
+    /* long titles are cut at a character boundary to fit the slot */
+    len = strlen(title);
+    if (len >= JOURNAL_TITLE_SIZE) {
+        len = JOURNAL_TITLE_SIZE - 1;
+        while (len > 0 && (title[len] & 0xc0) == 0x80) {
+            len--;
+        }
+    }
+    key = g_strndup(title, len);
+
+    if ((old = g_hash_table_lookup(j->title_ids, key)) &&
+            ! journal_title_stale(j, GPOINTER_TO_UINT(old) - 1)) {
+        g_free(key);
+        return GPOINTER_TO_UINT(old) - 1;
+    }
+
+    /* the next slot, the title in it goes away */
+    id = j->header->titles_written % slots;
+    slot = j->titles + (size_t)id * JOURNAL_TITLE_SIZE;
+    if ((old = g_hash_table_lookup(j->title_ids, slot)) &&
+            GPOINTER_TO_UINT(old) - 1 == id) {
+        g_hash_table_remove(j->title_ids, slot);
+    }
+    memset(slot, 0, JOURNAL_TITLE_SIZE);
+    memcpy(slot, key, len);
+    j->title_seq[id] = j->header->titles_written++;
+    g_hash_table_replace(j->title_ids, key, GUINT_TO_POINTER(id + 1));
+    return id;
+}/*}}}*/
+
+static void journal_append (journal *j, guint32 type, Window win, /*{{{*/
+        journal_window *info) {
+    journal_record *r = &j->records[j->header->written % j->header->capacity];
+
+    if (info && info->title_str && journal_title_stale(j, info->title)) {
+        info->title = journal_title_id(j, info->title_str);
+    }
+
+    r->time = g_get_monotonic_time();
+    r->window = win;
+    r->title = info ? info->title : JOURNAL_NO_TITLE;
+    r->desktop = info ? info->desktop : -1;
+    r->type = type;
+    /* the record is complete before the reader can see it */
+    __sync_synchronize();
+    j->header->written++;
+}/*}}}*/
+
+static gint32 get_desktop_property (Display *disp, Window win, /*{{{*/
+        const char *prop) {
+    unsigned long *desktop;
+    gint32 ret = -1;
+
+    if ((desktop = (unsigned long *)get_property(disp, win,
+            XA_CARDINAL, (gchar *)prop, NULL))) {
+        ret = (gint32)*desktop;
+        g_free(desktop);
+    }
+    return ret;
+}/*}}}*/
+
+static void journal_update_title (Display *disp, journal *j, /*{{{*/
+        Window win, journal_window *info) {
+    g_free(info->title_str);
+    info->title_str = get_window_title(disp, win);
+    info->title = journal_title_id(j, info->title_str);
+}/*}}}*/
+
+static void journal_window_free (gpointer data) {/*{{{*/
+    journal_window *info = data;
+    g_free(info->title_str);
+    g_free(info);
+}/*}}}*/
+
+static void journal_sync_clients (Display *disp, journal *j, /*{{{*/
+        GHashTable *windows) {
+    /* record the windows added to and removed from the client list */
+    GHashTable *current = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GHashTableIter iter;
+    gpointer key, value;
+    Window *client_list;
+    unsigned long client_list_size;
+    int i;
+
+    if ((client_list = get_client_list(disp, &client_list_size)) == NULL) {
+        g_hash_table_destroy(current);
+        return;
+    }
+
+    for (i = 0; i < client_list_size / sizeof(Window); i++) {
+        Window win = client_list[i];
+        journal_window *info;
+
+        g_hash_table_insert(current, GSIZE_TO_POINTER(win), NULL);
+        if (g_hash_table_lookup(windows, GSIZE_TO_POINTER(win))) {
+            continue;
+        }
+        XSelectInput(disp, win, PropertyChangeMask);
+        info = g_new0(journal_window, 1);
+        info->desktop = get_desktop_property(disp, win, "_NET_WM_DESKTOP");
+        journal_update_title(disp, j, win, info);
+        g_hash_table_insert(windows, GSIZE_TO_POINTER(win), info);
+        journal_append(j, JOURNAL_NEW, win, info);
+    }
+
+    g_hash_table_iter_init(&iter, windows);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        if (! g_hash_table_contains(current, key)) {
+            journal_append(j, JOURNAL_GONE, GPOINTER_TO_SIZE(key), value);
+            g_hash_table_iter_remove(&iter);
+        }
+    }
+
+    g_free(client_list);
+    g_hash_table_destroy(current);
+}/*}}}*/
+
+static int record_journal (Display *disp) {/*{{{*/
+    /* Append the window events to the journal until interrupted. The
+     * records come from PropertyNotify on the root window (the client
+     * list, the active window and the current desktop) and on the
+     * clients (title, desktop and state). */
+    Window root = DefaultRootWindow(disp);
+    const char *atom_names[] = {
+        "_NET_CLIENT_LIST", "_NET_ACTIVE_WINDOW", "_NET_CURRENT_DESKTOP",
+        "_NET_WM_NAME", "_NET_WM_DESKTOP", "_NET_WM_STATE"
+    };
+    enum { CLIENT_LIST, ACTIVE_WINDOW, CURRENT_DESKTOP, WM_NAME, WM_DESKTOP,
+        WM_STATE, N_ATOMS };
+    Atom atoms[N_ATOMS];
+    GHashTable *windows;
+    guint64 first;
+    journal j;
+    XEvent event;
+
+    if (! journal_open(&j, options.param_journal, options.journal_size ?
+            options.journal_size : DEFAULT_JOURNAL_RECORDS)) {
+        journal_close(&j);
+        return EXIT_FAILURE;
+    }
+    XInternAtoms(disp, (char **)atom_names, N_ATOMS, False, atoms);
+    windows = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+            journal_window_free);
+    first = j.header->written;
+
+    init_interrupt_handler();
+    XSelectInput(disp, root, PropertyChangeMask);
+    journal_sync_clients(disp, &j, windows);
+
+    while (next_event(disp, &event, -1)) {
+        Window win = event.xproperty.window;
+        Atom atom = event.xproperty.atom;
+        journal_window *info;
+
+        if (event.type != PropertyNotify) {
+            continue;
+        }
+
+        if (win == root) {
+            if (atom == atoms[CLIENT_LIST]) {
+                journal_sync_clients(disp, &j, windows);
+            }
+            else if (atom == atoms[ACTIVE_WINDOW]) {
+                Window active = get_active_window(disp);
+                journal_append(&j, JOURNAL_FOCUS, active,
+                        g_hash_table_lookup(windows, GSIZE_TO_POINTER(active)));
+            }
+            else if (atom == atoms[CURRENT_DESKTOP]) {
+                journal_window desktop = {
+                    get_desktop_property(disp, root, "_NET_CURRENT_DESKTOP"),
+                    JOURNAL_NO_TITLE, NULL
+                };
+                journal_append(&j, JOURNAL_DESKTOP, 0, &desktop);
+            }
+            continue;
+        }
+
+        if (! (info = g_hash_table_lookup(windows, GSIZE_TO_POINTER(win)))) {
+            continue;
+        }
+        if (atom == atoms[WM_NAME] || atom == XA_WM_NAME) {
+            guint32 old = info->title;
+            journal_update_title(disp, &j, win, info);
+            if (info->title != old) {
+                journal_append(&j, JOURNAL_TITLE, win, info);
+            }
+        }
+        else if (atom == atoms[WM_DESKTOP]) {
+            info->desktop = get_desktop_property(disp, win, "_NET_WM_DESKTOP");
+            journal_append(&j, JOURNAL_MOVE, win, info);
+        }
+        else if (atom == atoms[WM_STATE]) {
+            journal_append(&j, JOURNAL_STATE, win, info);
+        }
+    }
+
+    printf("Recorded %lu events.\n", (unsigned long)(j.header->written - first));
+    g_hash_table_destroy(windows);
+    journal_close(&j);
+    return timed_out ? EXIT_FAILURE : EXIT_SUCCESS;
+}/*}}}*/
+
+static gboolean parse_journal_time (const char *arg, gint64 *time) {/*{{{*/
+    /* seconds of the monotonic clock, negative values count back from now */
+    gchar *end;
+    gdouble seconds = g_ascii_strtod(arg, &end);
+
+    if (end == arg || *end) {
+        return FALSE;
+    }
+    *time = (gint64)(seconds * G_USEC_PER_SEC);
+    if (seconds < 0) {
+        *time += g_get_monotonic_time();
+    }
+    return TRUE;
+}/*}}}*/
+
+static int dump_journal (void) {/*{{{*/
+    /* print the records of the journal, oldest first, optionally only
+     * those in the --from/--to range and of the -r window */
+    journal j;
+    unsigned long wid = 0;
+    match_pattern pattern;
+    gboolean by_title = FALSE;
+    guint64 written, i;
+
+    if (options.param_window) {
+        if (options.match_by_id) {
+            if (! parse_window_id(options.param_window, &wid)) {
+                return EXIT_FAILURE;
+            }
+        }
+        else {
+            match_pattern_init(&pattern, options.param_window);
+            by_title = TRUE;
+        }
+    }
+
+    if (! journal_map(&j, options.param_journal, FALSE, 0)) {
+        if (by_title) {
+            match_pattern_clear(&pattern);
+        }
+        return EXIT_FAILURE;
+    }
+    j.titles = journal_map_titles(options.param_journal, j.header->capacity,
+            FALSE, &j.titles_map_size);
+
+    written = j.header->written;
+    i = written > j.header->capacity ? written - j.header->capacity : 0;
+    for (; i < written; i++) {
+        journal_record r = j.records[i % j.header->capacity];
+        const gchar *title = j.titles && r.title < j.header->capacity * 2 ?
+            j.titles + (size_t)r.title * JOURNAL_TITLE_SIZE : NULL;
+        gchar *title_out;
+
+        if ((options.journal_from && (gint64)r.time < options.journal_from) ||
+                (options.journal_to && (gint64)r.time > options.journal_to) ||
+                (wid && r.window != wid) ||
+                (by_title && ! (title && str_matches_pattern(title, &pattern)))) {
+            continue;
+        }
+
+        title_out = title ? get_output_str((gchar *)title, TRUE) : NULL;
+        printf("%lu.%06lu %-7s 0x%.8lx %2d %s\n",
+                (unsigned long)(r.time / G_USEC_PER_SEC),
+                (unsigned long)(r.time % G_USEC_PER_SEC),
+                journal_event_names[r.type < JOURNAL_EVENT_COUNT ? r.type : 0],
+                (unsigned long)r.window, r.desktop,
+                title_out ? title_out : "N/A");
+        g_free(title_out);
+    }
+
+    if (by_title) {
+        match_pattern_clear(&pattern);
+    }
+    journal_close(&j);
+    return EXIT_SUCCESS;
+}/*}}}*/
+
+#define PROBE_WAIT 1000     /* ms to wait for the reaction to one request */
+#define PROBE_STATE_NAME "above"    /* toggled by the _NET_WM_STATE probe */
+
+/* the requests measured by --probe-latency */
+enum {
+    PROBE_MOVERESIZE,
+    PROBE_STATE,
+    PROBE_ACTIVE,
+    PROBE_DESKTOP,
+    PROBE_CLOSE,
+    PROBE_COUNT
+};
+
+static const char *probe_names[PROBE_COUNT] = {
+    "_NET_MOVERESIZE_WINDOW", "_NET_WM_STATE", "_NET_ACTIVE_WINDOW",
+    "_NET_CURRENT_DESKTOP", "_NET_CLOSE_WINDOW"
+};
+
+/* what the window manager is expected to do */
+typedef struct {
+    int type;
+    Window win;
+    unsigned long value;    /* active window, desktop, width or state */
+    unsigned long value2;   /* height */
+} probe_expect;
+
+static gboolean probe_observed (Display *disp, XEvent *event, /*{{{*/
+        const probe_expect *expect) {
+    /* does the event show the expected reaction? The property is read
+     * back, because the notification alone doesn't say it has the new
+     * value. */
+    Window root = DefaultRootWindow(disp);
+    unsigned long state;
+    unsigned long *desktop;
+    gboolean ret;
+
+    switch (expect->type) {
+        case PROBE_MOVERESIZE:
+            return event->type == ConfigureNotify &&
+                event->xconfigure.window == expect->win &&
+                event->xconfigure.width == expect->value &&
+                event->xconfigure.height == expect->value2;
+        case PROBE_STATE:
+            if (event->type != PropertyNotify ||
+                    event->xproperty.window != expect->win ||
+                    event->xproperty.atom != XInternAtom(disp, "_NET_WM_STATE", False)) {
+                return FALSE;
+            }
+            get_window_state(disp, expect->win, &state);
+            return (state & wm_state_bit(PROBE_STATE_NAME)) == expect->value;
+        case PROBE_ACTIVE:
+            return event->type == PropertyNotify &&
+                event->xproperty.window == root &&
+                event->xproperty.atom == XInternAtom(disp, "_NET_ACTIVE_WINDOW", False) &&
+                get_active_window(disp) == expect->value;
+        case PROBE_DESKTOP:
+            if (event->type != PropertyNotify || event->xproperty.window != root ||
+                    event->xproperty.atom != XInternAtom(disp, "_NET_CURRENT_DESKTOP", False)) {
+                return FALSE;
+            }
+            desktop = (unsigned long *)get_property(disp, root,
+                    XA_CARDINAL, "_NET_CURRENT_DESKTOP", NULL);
+            ret = desktop && *desktop == expect->value;
+            g_free(desktop);
+            return ret;
+        case PROBE_CLOSE:
+            /* the window manager asks the client to close the window */
+            return event->type == ClientMessage &&
+                event->xclient.window == expect->win &&
+                event->xclient.data.l[0] == XInternAtom(disp, "WM_DELETE_WINDOW", False);
+    }
+    return FALSE;
+}/*}}}*/
+
+static gint64 probe_wait (Display *disp, gint64 start, /*{{{*/
+        const probe_expect *expect) {
+    /* microseconds from start to the expected reaction, -1 if it
+     * didn't come within PROBE_WAIT */
+    gint64 deadline = start + PROBE_WAIT * 1000;
+    XEvent event;
+
+    while (next_event(disp, &event, deadline)) {
+        if (probe_observed(disp, &event, expect)) {
+            return g_get_monotonic_time() - start;
+        }
+    }
+    return -1;
+}/*}}}*/
+
+static Window probe_create_window (Display *disp, const char *title) {/*{{{*/
+    /* a throwaway window which takes part in the WM_DELETE_WINDOW
+     * protocol, so that _NET_CLOSE_WINDOW doesn't kill us */
+    Window root = DefaultRootWindow(disp);
+    Atom wm_delete = XInternAtom(disp, "WM_DELETE_WINDOW", False);
+    XClassHint class_hint = {"wmctrl-probe", "Wmctrl"};
+    Window win;
+    gint64 deadline = g_get_monotonic_time() + PROBE_WAIT * 1000;
+    XEvent event;
+
+    win = XCreateSimpleWindow(disp, root, 0, 0, 200, 150, 0,
+            BlackPixel(disp, DefaultScreen(disp)),
+            WhitePixel(disp, DefaultScreen(disp)));
+    XStoreName(disp, win, title);
+    XSetClassHint(disp, win, &class_hint);
+    XSetWMProtocols(disp, win, &wm_delete, 1);
+    XSelectInput(disp, win, StructureNotifyMask | PropertyChangeMask);
+    XMapWindow(disp, win);
+
+    /* managed once the window manager sets _NET_WM_DESKTOP or
+     * _NET_WM_STATE, or at least maps it */
+    while (next_event(disp, &event, deadline)) {
+        if ((event.type == MapNotify && event.xmap.window == win) ||
+                (event.type == PropertyNotify && event.xproperty.window == win)) {
+            break;
+        }
+    }
+    return win;
+}/*}}}*/
+
+static int compare_gint64 (const void *a, const void *b) {/*{{{*/
+    gint64 x = *(const gint64 *)a;
+    gint64 y = *(const gint64 *)b;
+    return x < y ? -1 : x > y;
+}/*}}}*/
+
+static double percentile_ms (gint64 *sorted, int n, int p) {/*{{{*/
+    /* nearest rank */
+    int rank = (p * n + 99) / 100;
+    return sorted[rank > 0 ? rank - 1 : 0] / 1000.0;
+}/*}}}*/
+
+static int probe_latency (Display *disp) {/*{{{*/
+    /* Send each request options.probe_count times to throwaway windows
+     * and measure the time until its effect can be observed. */
+    Window root = DefaultRootWindow(disp);
+    Window win[2];
+    Window orig_active = get_active_window(disp);
+    unsigned long *orig_desktop, *n_desktops;
+    gint64 *samples[PROBE_COUNT];
+    int n_samples[PROBE_COUNT] = {0};
+    int sent[PROBE_COUNT] = {0};
+    gchar *state_name = normalize_wm_state_name(PROBE_STATE_NAME);
+    Atom probe_state_atom = XInternAtom(disp, state_name, False);
+    int i, type;
+
+    g_free(state_name);
+    XSelectInput(disp, root, PropertyChangeMask);
+    win[0] = probe_create_window(disp, "wmctrl latency probe 1");
+    win[1] = probe_create_window(disp, "wmctrl latency probe 2");
+    orig_desktop = (unsigned long *)get_property(disp, root,
+            XA_CARDINAL, "_NET_CURRENT_DESKTOP", NULL);
+    n_desktops = (unsigned long *)get_property(disp, root,
+            XA_CARDINAL, "_NET_NUMBER_OF_DESKTOPS", NULL);
+
+    for (type = 0; type < PROBE_COUNT; type++) {
+        samples[type] = g_new(gint64, options.probe_count);
+    }
+
+    for (type = 0; type < PROBE_COUNT && ! interrupted && ! timed_out; type++) {
+        if (! wm_supports(disp, probe_names[type])) {
+            p_verbose("%s isn't supported, skipped.\n", probe_names[type]);
+            continue;
+        }
+        if (type == PROBE_DESKTOP && ! (orig_desktop && n_desktops &&
+                    *n_desktops > 1)) {
+            p_verbose("%s needs two desktops, skipped.\n", probe_names[type]);
+            continue;
+        }
+
+        for (i = 0; i < options.probe_count; i++) {
+            probe_expect expect = {type, win[0], 0, 0};
+            gint64 start, latency;
+
+            start = g_get_monotonic_time();
+            switch (type) {
+                case PROBE_MOVERESIZE:
+                    expect.value = i % 2 ? 200 : 240;
+                    expect.value2 = i % 2 ? 150 : 180;
+                    client_msg(disp, win[0], "_NET_MOVERESIZE_WINDOW",
+                            0xf00, 40, 40, expect.value, expect.value2);
+                    break;
+                case PROBE_STATE:
+                    expect.value = i % 2 ? 0 : wm_state_bit(PROBE_STATE_NAME);
+                    client_msg(disp, win[0], "_NET_WM_STATE",
+                            i % 2 ? _NET_WM_STATE_REMOVE : _NET_WM_STATE_ADD,
+                            probe_state_atom, 0, 0, 0);
+                    break;
+                case PROBE_ACTIVE:
+                    expect.value = win[(i + 1) % 2];
+                    client_msg(disp, expect.value, "_NET_ACTIVE_WINDOW",
+                            0, 0, 0, 0, 0);
+                    break;
+                case PROBE_DESKTOP:
+                    expect.value = i % 2 ? *orig_desktop :
+                        (*orig_desktop + 1) % *n_desktops;
+                    client_msg(disp, root, "_NET_CURRENT_DESKTOP",
+                            expect.value, 0, 0, 0, 0);
+                    break;
+                case PROBE_CLOSE:
+                    close_window(disp, win[0]);
+                    break;
+            }
+            sent[type]++;
+
+            if ((latency = probe_wait(disp, start, &expect)) >= 0) {
+                samples[type][n_samples[type]++] = latency;
+            }
+            if (interrupted || timed_out) {
+                break;
+            }
+        }
+    }
+
+    /* clean up: back to the original desktop and active window */
+    if (orig_desktop && sent[PROBE_DESKTOP] % 2) {
+        client_msg(disp, root, "_NET_CURRENT_DESKTOP", *orig_desktop, 0, 0, 0, 0);
+    }
+    XDestroyWindow(disp, win[0]);
+    XDestroyWindow(disp, win[1]);
+    if (orig_active) {
+        client_msg(disp, orig_active, "_NET_ACTIVE_WINDOW", 0, 0, 0, 0, 0);
+    }
+    XSync(disp, False);
+
+    printf("%-24s %5s %5s %9s %9s %9s\n", "request", "sent", "lost",
+            "p50 ms", "p95 ms", "p99 ms");
+    for (type = 0; type < PROBE_COUNT; type++) {
+        int n = n_samples[type];
+        if (sent[type] == 0) {
+            printf("%-24s %5s\n", probe_names[type], "-");
+            continue;
+        }
+        printf("%-24s %5d %5d", probe_names[type], sent[type], sent[type] - n);
+        if (n > 0) {
+            qsort(samples[type], n, sizeof(gint64), compare_gint64);
+            printf(" %9.3f %9.3f %9.3f\n", percentile_ms(samples[type], n, 50),
+                    percentile_ms(samples[type], n, 95),
+                    percentile_ms(samples[type], n, 99));
+        }
+        else {
+            printf(" %9s %9s %9s\n", "-", "-", "-");
+        }
+        g_free(samples[type]);
+    }
+
+    g_free(orig_desktop);
+    g_free(n_desktops);
+    return timed_out ? EXIT_FAILURE : EXIT_SUCCESS;
+}/*}}}*/
+
+/* a property as returned by XGetWindowProperty() */
+typedef struct {
+    Atom name;
+    Atom type;
+    int format;
+    unsigned long nitems;
+    unsigned char *data;    /* format 32 items are longs, free with g_free() */
+} prop_value;
+
+#define PROPS_BATCH 16      /* windows per burst of --props-all */
+
+static void json_append_string (GString *out, const gchar *str, /*{{{*/
+        gssize len, gboolean latin1) {
+    /* a JSON string from UTF-8 or, for the STRING type, ISO-8859-1 */
+    gchar *utf8 = NULL;
+    const gchar *p, *end;
+
+    if (len < 0) {
+        len = strlen(str);
+    }
+    if (latin1 || ! g_utf8_validate(str, len, NULL)) {
+        if ((utf8 = g_convert(str, len, "UTF-8", "ISO-8859-1",
+                NULL, NULL, NULL))) {
+            str = utf8;
+            len = strlen(utf8);
+        }
+    }
+
+    g_string_append_c(out, '"');
+    for (p = str, end = str + len; p < end; p++) {
+        switch (*p) {
+            case '"':  g_string_append(out, "\\\""); break;
+            case '\\': g_string_append(out, "\\\\"); break;
+            case '\n': g_string_append(out, "\\n"); break;
+            case '\t': g_string_append(out, "\\t"); break;
+            default:
+                if ((guchar)*p < 0x20) {
+                    g_string_append_printf(out, "\\u%04x", (guchar)*p);
+                }
+                else {
+                    g_string_append_c(out, *p);
+                }
+        }
+    }
+    g_string_append_c(out, '"');
+    g_free(utf8);
+}/*}}}*/
+
+static void json_append_atom (GString *out, GHashTable *names, /*{{{*/
+        Atom atom) {
+    const gchar *name = g_hash_table_lookup(names, GSIZE_TO_POINTER(atom));
+
+    if (name) {
+        json_append_string(out, name, -1, FALSE);
+    }
+    else {
+        g_string_append_printf(out, "%lu", atom);
+    }
+}/*}}}*/
+
+static void json_append_fields (GString *out, const long *data, /*{{{*/
+        unsigned long nitems, const char **fields, const long *flags) {
+    /* an object of the fields present according to flags[i] & data[0],
+     * a flag of 0 means always present */
+    gboolean first = TRUE;
+    int i;
+
+    g_string_append_c(out, '{');
+    for (i = 0; fields[i] && i < nitems; i++) {
+        if (flags[i] && ! (data[0] & flags[i])) {
+            continue;
+        }
+        g_string_append_printf(out, "%s\"%s\": %ld", first ? "" : ", ",
+                fields[i], data[i]);
+        first = FALSE;
+    }
+    g_string_append_c(out, '}');
+}/*}}}*/
+
+static void json_append_prop (GString *out, Display *disp, /*{{{*/
+        const prop_value *prop, GHashTable *names) {
+    /* decode the value by its type, unknown types as a list of numbers */
+    static const char *wm_hints_fields[] = {
+        "flags", "input", "initial_state", "icon_pixmap", "icon_window",
+        "icon_x", "icon_y", "icon_mask", "window_group", NULL};
+    static const long wm_hints_flags[] = {
+        0, InputHint, StateHint, IconPixmapHint, IconWindowHint,
+        IconPositionHint, IconPositionHint, IconMaskHint, WindowGroupHint};
+    static const char *size_hints_fields[] = {
+        "flags", "x", "y", "width", "height", "min_width", "min_height",
+        "max_width", "max_height", "width_inc", "height_inc",
+        "min_aspect_x", "min_aspect_y", "max_aspect_x", "max_aspect_y",
+        "base_width", "base_height", "win_gravity", NULL};
+    static const long size_hints_flags[] = {
+        0, USPosition | PPosition, USPosition | PPosition,
+        USSize | PSize, USSize | PSize, PMinSize, PMinSize,
+        PMaxSize, PMaxSize, PResizeInc, PResizeInc,
+        PAspect, PAspect, PAspect, PAspect,
+        PBaseSize, PBaseSize, PWinGravity};
+    const long *l = (const long *)prop->data;
+    Atom xa_utf8 = XInternAtom(disp, "UTF8_STRING", False);
+    Atom xa_wm_state = XInternAtom(disp, "WM_STATE", False);
+    Atom xa_icon = XInternAtom(disp, "_NET_WM_ICON", False);
+    unsigned long i;
+
+    if (prop->format == 8 && (prop->type == XA_STRING || prop->type == xa_utf8)) {
+        /* lists of strings are separated by NULs, e.g. WM_CLASS */
+        const gchar *s = (const gchar *)prop->data;
+        unsigned long len = prop->nitems;
+        gboolean list;
+
+        if (len && s[len - 1] == '\0') {
+            len--;
+        }
+        if ((list = memchr(s, '\0', len) != NULL)) {
+            g_string_append_c(out, '[');
+        }
+        for (i = 0; i <= len; ) {
+            gsize n = strnlen(s + i, len - i);
+            if (i) {
+                g_string_append(out, ", ");
+            }
+            json_append_string(out, s + i, n, prop->type == XA_STRING);
+            i += n + 1;
+        }
+        if (list) {
+            g_string_append_c(out, ']');
+        }
+        return;
+    }
+
+    if (prop->format == 32 && prop->name == xa_icon) {
+        /* the sizes only, the pixels are for --icon */
+        g_string_append_c(out, '[');
+        for (i = 0; i + 2 <= prop->nitems; ) {
+            unsigned long w = l[i], h = l[i + 1];
+            g_string_append_printf(out, "%s\"%lux%lu\"", i ? ", " : "", w, h);
+            if (w * h > prop->nitems - i - 2) {
+                break;
+            }
+            i += 2 + w * h;
+        }
+        g_string_append_c(out, ']');
+        return;
+    }
+
+    if (prop->format == 32 && prop->type == XA_WM_HINTS) {
+        json_append_fields(out, l, prop->nitems, wm_hints_fields, wm_hints_flags);
+        return;
+    }
+    if (prop->format == 32 && prop->type == XA_WM_SIZE_HINTS) {
+        json_append_fields(out, l, prop->nitems, size_hints_fields,
+                size_hints_flags);
+        return;
+    }
+    if (prop->format == 32 && prop->type == xa_wm_state && prop->nitems >= 2) {
+        g_string_append_printf(out, "{\"state\": %ld, \"icon\": \"0x%.8lx\"}",
+                l[0], (unsigned long)l[1]);
+        return;
+    }
+
+    g_string_append_c(out, '[');
+    for (i = 0; i < prop->nitems; i++) {
+        if (i) {
+            g_string_append(out, ", ");
+        }
+        if (prop->format == 8) {
+            g_string_append_printf(out, "%u", prop->data[i]);
+        }
+        else if (prop->format == 16) {
+            g_string_append_printf(out, "%d", ((const short *)prop->data)[i]);
+        }
+        else if (prop->type == XA_ATOM) {
+            json_append_atom(out, names, l[i]);
+        }
+        else if (prop->type == XA_WINDOW || prop->type == XA_PIXMAP ||
+                prop->type == XA_DRAWABLE || prop->type == XA_COLORMAP ||
+                prop->type == XA_CURSOR) {
+            g_string_append_printf(out, "\"0x%.8lx\"", (unsigned long)l[i]);
+        }
+        else if (prop->type == XA_INTEGER) {
+            g_string_append_printf(out, "%ld", l[i]);
+        }
+        else {
+            /* CARDINAL and the rest, 32 bits without sign */
+            g_string_append_printf(out, "%lu", (unsigned long)l[i] & 0xffffffffUL);
+        }
+    }
+    g_string_append_c(out, ']');
+}/*}}}*/
+
+static int windows_props_json (Display *disp, const Window *wins, /*{{{*/
+        int n, GString *out) {
+    /* All the properties of the windows as JSON objects separated by
+     * ",\n", returns the number of objects; windows which vanish are
+     * left out. The windows go in batches of PROPS_BATCH: the
+     * ListProperties requests of a batch go out through XCB in one
+     * burst, then the GetProperty requests of all their properties in
+     * another, then a single XGetAtomNames() for the property names,
+     * their types and the values of the ATOM properties. That is three
+     * round trips per batch. */
+    xcb_connection_t *conn = XGetXCBConnection(disp);
+    int done = 0;
+    int first;
+
+    for (first = 0; first < n; first += PROPS_BATCH) {
+        int count = MIN(n - first, PROPS_BATCH);
+        xcb_list_properties_cookie_t list_cookies[PROPS_BATCH];
+        xcb_get_property_cookie_t *cookies[PROPS_BATCH];
+        prop_value *props[PROPS_BATCH];
+        int n_props[PROPS_BATCH];
+        gboolean vanished[PROPS_BATCH];
+        GArray *lookup = g_array_new(FALSE, FALSE, sizeof(Atom));
+        GHashTable *atom_names;
+        char **names;
+        int i, k;
+        unsigned long j;
+
+        for (k = 0; k < count; k++) {
+            list_cookies[k] = xcb_list_properties(conn, wins[first + k]);
+        }
+
+        /* the values of every property of the batch at once */
+        for (k = 0; k < count; k++) {
+            xcb_generic_error_t *err = NULL;
+            xcb_list_properties_reply_t *list =
+                xcb_list_properties_reply(conn, list_cookies[k], &err);
+            xcb_atom_t *atoms;
+
+            vanished[k] = list == NULL;
+            n_props[k] = list ? xcb_list_properties_atoms_length(list) : 0;
+            props[k] = g_new0(prop_value, n_props[k]);
+            cookies[k] = g_new(xcb_get_property_cookie_t, n_props[k] + 1);
+            atoms = list ? xcb_list_properties_atoms(list) : NULL;
+            for (i = 0; i < n_props[k]; i++) {
+                props[k][i].name = atoms[i];
+                cookies[k][i] = xcb_get_property(conn, 0, wins[first + k],
+                        atoms[i], XCB_GET_PROPERTY_TYPE_ANY, 0,
+                        G_MAXUINT32 / 4);
+            }
+            free(list);
+            free(err);
+        }
+
+        for (k = 0; k < count; k++) {
+            for (i = 0; i < n_props[k]; i++) {
+                prop_value *prop = &props[k][i];
+                xcb_generic_error_t *err = NULL;
+                xcb_get_property_reply_t *reply =
+                    xcb_get_property_reply(conn, cookies[k][i], &err);
+
+                if (err && err->error_code == BadWindow) {
+                    vanished[k] = TRUE;
+                }
+                if (reply) {
+                    prop->type = reply->type;
+                    prop->format = reply->format;
+                    prop->nitems = reply->value_len;
+                    prop->data = (unsigned char *)property_reply_data(reply, NULL);
+                }
+                free(reply);
+                free(err);
+
+                if (vanished[k]) {
+                    continue;
+                }
+                g_array_append_val(lookup, prop->name);
+                if (prop->type) {
+                    g_array_append_val(lookup, prop->type);
+                }
+                for (j = 0; prop->type == XA_ATOM && prop->format == 32 &&
+                        j < prop->nitems; j++) {
+                    Atom value = ((long *)prop->data)[j];
+                    if (value) {
+                        g_array_append_val(lookup, value);
+                    }
+                }
+            }
+            g_free(cookies[k]);
+        }
+
+        /* all the names in one request, a bogus atom in a value only
+         * leaves its name unknown */
+        names = g_new0(char *, lookup->len + 1);
+        atom_names = g_hash_table_new(g_direct_hash, g_direct_equal);
+        ignore_bad_atoms = TRUE;
+        XGetAtomNames(disp, (Atom *)lookup->data, lookup->len, names);
+        ignore_bad_atoms = FALSE;
+        for (j = 0; j < lookup->len; j++) {
+            if (names[j]) {
+                g_hash_table_insert(atom_names,
+                        GSIZE_TO_POINTER(g_array_index(lookup, Atom, j)), names[j]);
+            }
+        }
+
+        for (k = 0; k < count; k++) {
+            if (! vanished[k]) {
+                g_string_append_printf(out, "%s{\"window\": \"0x%.8lx\", "
+                        "\"properties\": {", done ? ",\n" : "", wins[first + k]);
+            }
+            for (i = 0; i < n_props[k]; i++) {
+                if (! vanished[k]) {
+                    g_string_append(out, i ? ",\n  " : "\n  ");
+                    json_append_atom(out, atom_names, props[k][i].name);
+                    g_string_append(out, ": {\"type\": ");
+                    json_append_atom(out, atom_names, props[k][i].type);
+                    g_string_append_printf(out, ", \"format\": %d, \"value\": ",
+                            props[k][i].format);
+                    json_append_prop(out, disp, &props[k][i], atom_names);
+                    g_string_append_c(out, '}');
+                }
+                g_free(props[k][i].data);
+            }
+            if (! vanished[k]) {
+                g_string_append(out, n_props[k] ? "\n}}" : "}}");
+                done++;
+            }
+            g_free(props[k]);
+        }
+
+        for (j = 0; j < lookup->len; j++) {
+            if (names[j]) {
+                XFree(names[j]);
+            }
+        }
+        g_free(names);
+        g_hash_table_destroy(atom_names);
+        g_array_free(lookup, TRUE);
+    }
+    return done;
+}/*}}}*/
+
+static int print_window_props (Display *disp, Window win) {/*{{{*/
+    GString *out = g_string_new("");
+    int ret = EXIT_SUCCESS;
+
+    if (windows_props_json(disp, &win, 1, out)) {
+        puts(out->str);
+    }
+    else {
+        fprintf(stderr, "Window 0x%.8lx doesn't exist.\n", win);
+        ret = EXIT_FAILURE;
+    }
+    g_string_free(out, TRUE);
+    return ret;
+}/*}}}*/
+
+static int print_all_props (Display *disp) {/*{{{*/
+    /* a JSON array with an object for each client */
+    Window *client_list;
+    unsigned long client_list_size;
+    GString *out = g_string_new("[\n");
+    int n;
+
+    if ((client_list = get_client_list(disp, &client_list_size)) == NULL) {
+        g_string_free(out, TRUE);
+        return EXIT_FAILURE;
+    }
+
+    n = filter_windows_by_state(disp, client_list,
+            client_list_size / sizeof(Window));
+    if (windows_props_json(disp, client_list, n, out)) {
+        g_string_append(out, "\n]");
+    }
+    else {
+        g_string_assign(out, "[]");
+    }
+    puts(out->str);
+
+    g_string_free(out, TRUE);
+    g_free(client_list);
+    return EXIT_SUCCESS;
+}/*}}}*/
+
+/* the keys of the desktop counts of --summary, the others are the
+ * desktop + 2 */
+#define SUMMARY_NO_DESKTOP 0
+#define SUMMARY_ALL_DESKTOPS 1
+
+static guint summary_desktop_key (const unsigned long *desktop) {/*{{{*/
+    if (! desktop) {
+        return SUMMARY_NO_DESKTOP;
+    }
+    /* Xlib sign extends the cardinal, so only its low 32 bits count */
+    if ((guint32)*desktop == STICKY_DESKTOP) {
+        return SUMMARY_ALL_DESKTOPS;
+    }
+    return (guint32)*desktop + 2;
+}/*}}}*/
+
+static gchar *summary_desktop_name (guint key) {/*{{{*/
+    if (key == SUMMARY_NO_DESKTOP) {
+        return g_strdup("none");
+    }
+    if (key == SUMMARY_ALL_DESKTOPS) {
+        return g_strdup("-1");
     }
+    return g_strdup_printf("%u", key - 2);
+}/*}}}*/
 
-    return action_window(disp, (Window)wid, mode);
+static gint compare_desktop_keys (gconstpointer a, gconstpointer b) {/*{{{*/
+    /* the desktops in order, then all desktops, then no desktop */
+    guint x = GPOINTER_TO_UINT(a);
+    guint y = GPOINTER_TO_UINT(b);
+    x = x >= 2 ? x - 2 : G_MAXUINT - x;
+    y = y >= 2 ? y - 2 : G_MAXUINT - y;
+    return x < y ? -1 : x > y;
 }/*}}}*/
 
-static int action_window_str (Display *disp, char mode) {/*{{{*/
-    Window activate = 0;
+static gint compare_class_counts (gconstpointer a, gconstpointer b, /*{{{*/
+        gpointer counts) {
+    /* the most frequent first, then by name */
+    guint x = GPOINTER_TO_UINT(g_hash_table_lookup(counts, a));
+    guint y = GPOINTER_TO_UINT(g_hash_table_lookup(counts, b));
+    return x != y ? (x > y ? -1 : 1) : strcmp(a, b);
+}/*}}}*/
+
+static int print_summary (Display *disp) {/*{{{*/
+    /* Count the windows per desktop, per WM_CLASS class name and, with
+     * --show-state, per state. Only these properties are fetched: the
+     * requests for all the windows go out through XCB in one burst, and
+     * a second burst asks for _WIN_WORKSPACE where _NET_WM_DESKTOP is
+     * missing. The classes are counted as they come from the server. */
     Window *client_list;
     unsigned long client_list_size;
-    int i;
+    GHashTable *desktops = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GHashTable *classes = g_hash_table_new_full(g_str_hash, g_str_equal,
+            g_free, NULL);
+    guint state_counts[WM_STATE_COUNT] = {0};
+    guint n_windows = 0;
+    gboolean with_state = options.show_state || options.filter_state;
+    xcb_get_property_cookie_t *state_cookies, *desktop_cookies, *class_cookies;
+    unsigned long **desktop_values;
+    gchar **class_values;
+    unsigned long *class_sizes, *states;
+    gboolean *skip;
+    GList *keys, *l;
+    int i, j, n;
 
-    if (strcmp(SELECT_WINDOW_MAGIC, options.param_window) == 0) {
-        activate = Select_Window(disp);
-        if (activate) {
-            return action_window(disp, activate, mode);
+    if ((client_list = get_client_list(disp, &client_list_size)) == NULL) {
+        g_hash_table_destroy(desktops);
+        g_hash_table_destroy(classes);
+        return EXIT_FAILURE;
+    }
+    n = client_list_size / sizeof(Window);
+    state_cookies = g_new(xcb_get_property_cookie_t, n + 1);
+    desktop_cookies = g_new(xcb_get_property_cookie_t, n + 1);
+    class_cookies = g_new(xcb_get_property_cookie_t, n + 1);
+    desktop_values = g_new0(unsigned long *, n + 1);
+    class_values = g_new0(gchar *, n + 1);
+    class_sizes = g_new0(unsigned long, n + 1);
+    states = g_new0(unsigned long, n + 1);
+    skip = g_new0(gboolean, n + 1);
+
+    if (with_state) {
+        init_wm_state_atoms(disp);
+    }
+    for (i = 0; i < n; i++) {
+        if (with_state) {
+            state_cookies[i] = get_property_request(disp, client_list[i],
+                    XA_ATOM, "_NET_WM_STATE");
         }
-        else {
-            return EXIT_FAILURE;
+        desktop_cookies[i] = get_property_request(disp, client_list[i],
+                XA_CARDINAL, "_NET_WM_DESKTOP");
+        class_cookies[i] = get_property_request(disp, client_list[i],
+                XA_STRING, "WM_CLASS");
+    }
+
+    /* the windows which vanished or don't pass the filter are skipped */
+    for (i = 0; i < n; i++) {
+        gboolean vanished;
+
+        if (with_state) {
+            unsigned long size = 0;
+            Atom *atoms = (Atom *)get_property_reply(disp, state_cookies[i],
+                    XA_ATOM, &size, NULL);
+            states[i] = state_from_atoms(atoms, atoms ? size : 0);
+            skip[i] = ! state_passes_filter(states[i]);
+            g_free(atoms);
         }
+        desktop_values[i] = (unsigned long *)get_property_reply(disp,
+                desktop_cookies[i], XA_CARDINAL, NULL, &vanished);
+        skip[i] |= vanished;
+        class_values[i] = get_property_reply(disp, class_cookies[i],
+                XA_STRING, &class_sizes[i], &vanished);
+        skip[i] |= vanished;
     }
-    if (strcmp(ACTIVE_WINDOW_MAGIC, options.param_window) == 0) {
-        activate = get_active_window(disp);
-        if (activate)
-        {
-            return action_window(disp, activate, mode);
+    for (i = 0; i < n; i++) {
+        if (! skip[i] && ! desktop_values[i]) {
+            desktop_cookies[i] = get_property_request(disp, client_list[i],
+                    XA_CARDINAL, "_WIN_WORKSPACE");
         }
-        else
-        {
-            return EXIT_FAILURE;
+    }
+    for (i = 0; i < n; i++) {
+        if (! skip[i] && ! desktop_values[i]) {
+            desktop_values[i] = (unsigned long *)get_property_reply(disp,
+                    desktop_cookies[i], XA_CARDINAL, NULL, NULL);
         }
     }
-    else {
-        if ((client_list = get_client_list(disp, &client_list_size)) == NULL) {
-            return EXIT_FAILURE;
+
+    for (i = 0; i < n; i++) {
+        unsigned long state = states[i];
+        unsigned long *desktop = desktop_values[i];
+        gchar *wm_class = class_values[i], *class_name;
+        unsigned long size = class_sizes[i];
+        guint key;
+
+        if (skip[i]) {
+            g_free(desktop);
+            g_free(wm_class);
+            continue;
         }
 
-        for (i = 0; i < client_list_size / sizeof(Window); i++) {
- 			gchar *match_utf8;
- 			if (options.show_class) {
- 	            match_utf8 = get_window_class(disp, client_list[i]); /* UTF8 */
- 			}
- 			else {
- 				match_utf8 = get_window_title(disp, client_list[i]); /* UTF8 */
- 			}
-            if (match_utf8) {
-                gchar *match;
-                gchar *match_cf;
-                gchar *match_utf8_cf = NULL;
-                if (envir_utf8) {
-                    match = g_strdup(options.param_window);
-                    match_cf = g_utf8_casefold(options.param_window, -1);
-                }
-                else {
-                    if (! (match = g_locale_to_utf8(options.param_window, -1, NULL, NULL, NULL))) {
-                        match = g_strdup(options.param_window);
-                    }
-                    match_cf = g_utf8_casefold(match, -1);
-                }
+        n_windows++;
+        key = summary_desktop_key(desktop);
+        g_hash_table_insert(desktops, GUINT_TO_POINTER(key), GUINT_TO_POINTER(
+                GPOINTER_TO_UINT(g_hash_table_lookup(desktops,
+                        GUINT_TO_POINTER(key))) + 1));
 
-                if (!match || !match_cf) {
-                    continue;
-                }
+        /* the class name follows the instance name */
+        class_name = "N/A";
+        if (wm_class && strlen(wm_class) + 1 < size) {
+            class_name = wm_class + strlen(wm_class) + 1;
+        }
+        g_hash_table_replace(classes, g_strdup(class_name), GUINT_TO_POINTER(
+                GPOINTER_TO_UINT(g_hash_table_lookup(classes, class_name)) + 1));
+
+        for (j = 0; j < WM_STATE_COUNT; j++) {
+            if (state & (1UL << j)) {
+                state_counts[j]++;
+            }
+        }
+        g_free(desktop);
+        g_free(wm_class);
+    }
+    g_free(state_cookies);
+    g_free(desktop_cookies);
+    g_free(class_cookies);
+    g_free(desktop_values);
+    g_free(class_values);
+    g_free(class_sizes);
+    g_free(states);
+    g_free(skip);
+    g_free(client_list);
 
-                match_utf8_cf = g_utf8_casefold(match_utf8, -1);
+    if (options.json) {
+        GString *out = g_string_new("");
 
-                if ((options.full_window_title_match && strcmp(match_utf8, match) == 0) ||
-                        (!options.full_window_title_match && strstr(match_utf8_cf, match_cf))) {
-                    activate = client_list[i];
-                    g_free(match);
-                    g_free(match_cf);
-                    g_free(match_utf8);
-                    g_free(match_utf8_cf);
-                    break;
+        g_string_append_printf(out, "{\"windows\": %u, \"desktops\": {", n_windows);
+        keys = g_list_sort(g_hash_table_get_keys(desktops), compare_desktop_keys);
+        for (l = keys; l; l = l->next) {
+            gchar *name = summary_desktop_name(GPOINTER_TO_UINT(l->data));
+            g_string_append_printf(out, "%s\"%s\": %u", l == keys ? "" : ", ",
+                    name, GPOINTER_TO_UINT(g_hash_table_lookup(desktops, l->data)));
+            g_free(name);
+        }
+        g_list_free(keys);
+
+        g_string_append(out, "}, \"classes\": {");
+        keys = g_list_sort_with_data(g_hash_table_get_keys(classes),
+                compare_class_counts, classes);
+        for (l = keys; l; l = l->next) {
+            g_string_append(out, l == keys ? "" : ", ");
+            json_append_string(out, l->data, -1, TRUE);
+            g_string_append_printf(out, ": %u",
+                    GPOINTER_TO_UINT(g_hash_table_lookup(classes, l->data)));
+        }
+        g_list_free(keys);
+        g_string_append_c(out, '}');
+
+        if (options.show_state) {
+            gboolean first = TRUE;
+            g_string_append(out, ", \"states\": {");
+            for (j = 0; j < WM_STATE_COUNT; j++) {
+                if (state_counts[j]) {
+                    g_string_append_printf(out, "%s\"%s\": %u", first ? "" : ", ",
+                            wm_state_names[j], state_counts[j]);
+                    first = FALSE;
                 }
-                g_free(match);
-                g_free(match_cf);
-                g_free(match_utf8);
-                g_free(match_utf8_cf);
             }
+            g_string_append_c(out, '}');
         }
-        g_free(client_list);
+        g_string_append_c(out, '}');
+        puts(out->str);
+        g_string_free(out, TRUE);
+    }
+    else {
+        printf("%-20s %u\n", "windows", n_windows);
+
+        keys = g_list_sort(g_hash_table_get_keys(desktops), compare_desktop_keys);
+        for (l = keys; l; l = l->next) {
+            gchar *desktop = summary_desktop_name(GPOINTER_TO_UINT(l->data));
+            gchar *name = g_strdup_printf("desktop %s", desktop);
+            printf("%-20s %u\n", name,
+                    GPOINTER_TO_UINT(g_hash_table_lookup(desktops, l->data)));
+            g_free(desktop);
+            g_free(name);
+        }
+        g_list_free(keys);
+
+        keys = g_list_sort_with_data(g_hash_table_get_keys(classes),
+                compare_class_counts, classes);
+        for (l = keys; l; l = l->next) {
+            gchar *name_out = get_output_str(l->data, FALSE);
+            gchar *name = g_strdup_printf("class %s", name_out ? name_out : (gchar *)l->data);
+            printf("%-20s %u\n", name,
+                    GPOINTER_TO_UINT(g_hash_table_lookup(classes, l->data)));
+            g_free(name);
+            g_free(name_out);
+        }
+        g_list_free(keys);
 
-        if (activate) {
-            return action_window(disp, activate, mode);
+        for (j = 0; options.show_state && j < WM_STATE_COUNT; j++) {
+            if (state_counts[j]) {
+                gchar *name = g_strdup_printf("state %s", wm_state_names[j]);
+                printf("%-20s %u\n", name, state_counts[j]);
+                g_free(name);
+            }
         }
-        else {
-            return EXIT_FAILURE;
+    }
+
+    g_hash_table_destroy(desktops);
+    g_hash_table_destroy(classes);
+    return EXIT_SUCCESS;
+}/*}}}*/
+
+#define DEFAULT_METRICS_INTERVAL 15     /* seconds */
+
+/* the state behind --metrics-out, kept up to date from the events */
+typedef struct {
+    GHashTable *windows;            /* client -> desktop */
+    gint32 current_desktop;
+    unsigned long focus_changes;
+    unsigned long created;
+    unsigned long destroyed;
+    double roundtrip;               /* seconds */
+} metrics;
+
+static void metrics_sync_clients (Display *disp, metrics *m, /*{{{*/
+        gboolean count) {
+    /* windows added to and removed from the client list */
+    GHashTable *current = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GHashTableIter iter;
+    gpointer key;
+    Window *client_list;
+    unsigned long client_list_size;
+    int i;
+
+    if ((client_list = get_client_list(disp, &client_list_size)) == NULL) {
+        g_hash_table_destroy(current);
+        return;
+    }
+
+    for (i = 0; i < client_list_size / sizeof(Window); i++) {
+        Window win = client_list[i];
+
+        g_hash_table_insert(current, GSIZE_TO_POINTER(win), NULL);
+        if (g_hash_table_contains(m->windows, GSIZE_TO_POINTER(win))) {
+            continue;
+        }
+        XSelectInput(disp, win, PropertyChangeMask);
+        g_hash_table_insert(m->windows, GSIZE_TO_POINTER(win), GINT_TO_POINTER(
+                get_desktop_property(disp, win, "_NET_WM_DESKTOP")));
+        m->created += count;
+    }
+
+    g_hash_table_iter_init(&iter, m->windows);
+    while (g_hash_table_iter_next(&iter, &key, NULL)) {
+        if (! g_hash_table_contains(current, key)) {
+            g_hash_table_iter_remove(&iter);
+            m->destroyed++;
         }
     }
+
+    g_free(client_list);
+    g_hash_table_destroy(current);
+}/*}}}*/
+
+static gboolean write_metrics (const metrics *m, const char *file) {/*{{{*/
+    /* the file is replaced atomically, so the collector never reads
+     * a partial one */
+    GHashTable *per_desktop = g_hash_table_new(g_direct_hash, g_direct_equal);
+    GHashTableIter iter;
+    gpointer key, value;
+    GString *out = g_string_new("");
+    GError *error = NULL;
+    gchar roundtrip[G_ASCII_DTOSTR_BUF_SIZE];   /* not in the locale's format */
+    gboolean ret;
+
+    g_hash_table_iter_init(&iter, m->windows);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        g_hash_table_insert(per_desktop, value, GUINT_TO_POINTER(
+                GPOINTER_TO_UINT(g_hash_table_lookup(per_desktop, value)) + 1));
+    }
+
+    g_string_append(out,
+            "# HELP wmctrl_windows Windows managed by the window manager per desktop.\n"
+            "# TYPE wmctrl_windows gauge\n");
+    g_hash_table_iter_init(&iter, per_desktop);
+    while (g_hash_table_iter_next(&iter, &key, &value)) {
+        g_string_append_printf(out, "wmctrl_windows{desktop=\"%d\"} %u\n",
+                GPOINTER_TO_INT(key), GPOINTER_TO_UINT(value));
+    }
+    g_string_append_printf(out,
+            "# HELP wmctrl_current_desktop The current desktop.\n"
+            "# TYPE wmctrl_current_desktop gauge\n"
+            "wmctrl_current_desktop %d\n"
+            "# HELP wmctrl_focus_changes_total Changes of the active window.\n"
+            "# TYPE wmctrl_focus_changes_total counter\n"
+            "wmctrl_focus_changes_total %lu\n"
+            "# HELP wmctrl_windows_created_total Windows added to the client list.\n"
+            "# TYPE wmctrl_windows_created_total counter\n"
+            "wmctrl_windows_created_total %lu\n"
+            "# HELP wmctrl_windows_destroyed_total Windows removed from the client list.\n"
+            "# TYPE wmctrl_windows_destroyed_total counter\n"
+            "wmctrl_windows_destroyed_total %lu\n"
+            "# HELP wmctrl_roundtrip_seconds Duration of the last round trip to the X server.\n"
+            "# TYPE wmctrl_roundtrip_seconds gauge\n"
+            "wmctrl_roundtrip_seconds %s\n",
+            m->current_desktop, m->focus_changes, m->created, m->destroyed,
+            g_ascii_formatd(roundtrip, sizeof(roundtrip), "%.6f", m->roundtrip));
+
+    /* written to a temporary file which is renamed over the old one */
+    if (! (ret = g_file_set_contents(file, out->str, out->len, &error))) {
+        fprintf(stderr, "Cannot write %s: %s\n", file, error->message);
+        g_error_free(error);
+    }
+
+    g_hash_table_destroy(per_desktop);
+    g_string_free(out, TRUE);
+    return ret;
 }/*}}}*/
 
+static int export_metrics (Display *disp) {/*{{{*/
+    /* Keep the metrics in the Prometheus text format in --metrics-out
+     * until interrupted. The counters are updated from PropertyNotify
+     * events, so nothing is polled between the writes except a single
+     * round trip to measure its latency. */
+    Window root = DefaultRootWindow(disp);
+    Atom xa_client_list = XInternAtom(disp, "_NET_CLIENT_LIST", False);
+    Atom xa_active = XInternAtom(disp, "_NET_ACTIVE_WINDOW", False);
+    Atom xa_current_desktop = XInternAtom(disp, "_NET_CURRENT_DESKTOP", False);
+    Atom xa_desktop = XInternAtom(disp, "_NET_WM_DESKTOP", False);
+    gint64 interval = (options.interval ? options.interval :
+            DEFAULT_METRICS_INTERVAL) * G_USEC_PER_SEC;
+    gint64 next_write;
+    metrics m;
+    XEvent event;
+    int ret = EXIT_SUCCESS;
+
+    memset(&m, 0, sizeof(m));
+    m.windows = g_hash_table_new(g_direct_hash, g_direct_equal);
+
+    init_interrupt_handler();
+    XSelectInput(disp, root, PropertyChangeMask);
+    m.current_desktop = get_desktop_property(disp, root, "_NET_CURRENT_DESKTOP");
+    metrics_sync_clients(disp, &m, FALSE);
+    next_write = g_get_monotonic_time();
+
+    for (;;) {
+        if (g_get_monotonic_time() >= next_write) {
+            gint64 start = g_get_monotonic_time();
+            XSync(disp, False);
+            m.roundtrip = (g_get_monotonic_time() - start) / (double)G_USEC_PER_SEC;
+            if (! write_metrics(&m, options.param_metrics)) {
+                ret = EXIT_FAILURE;
+                break;
+            }
+            next_write += interval;
+        }
+
+        if (! next_event(disp, &event, next_write)) {
+            if (interrupted || timed_out) {
+                break;
+            }
+            continue;
+        }
+        if (event.type != PropertyNotify) {
+            continue;
+        }
+
+        if (event.xproperty.window == root) {
+            if (event.xproperty.atom == xa_client_list) {
+                metrics_sync_clients(disp, &m, TRUE);
+            }
+            else if (event.xproperty.atom == xa_active) {
+                m.focus_changes++;
+            }
+            else if (event.xproperty.atom == xa_current_desktop) {
+                m.current_desktop = get_desktop_property(disp, root,
+                        "_NET_CURRENT_DESKTOP");
+            }
+        }
+        else if (event.xproperty.atom == xa_desktop &&
+                g_hash_table_contains(m.windows,
+                    GSIZE_TO_POINTER(event.xproperty.window))) {
+            g_hash_table_insert(m.windows,
+                    GSIZE_TO_POINTER(event.xproperty.window), GINT_TO_POINTER(
+                        get_desktop_property(disp, event.xproperty.window,
+                            "_NET_WM_DESKTOP")));
+        }
+    }
+
+    g_hash_table_destroy(m.windows);
+    return timed_out ? EXIT_FAILURE : ret;
+}/*}}}*/
 
 static int list_current_desktop (Display *disp) {/*{{{*/
     unsigned long *cur_desktop = NULL;
@@ -1352,6 +6944,151 @@ static int longest_str (gchar **strv) {/*{{{*/
     return max;
 }/*}}}*/
 
+typedef struct {
+    Window win;
+    guint top;      /* index of its top-level window in stacking order */
+    guint seq;      /* order in which it was found */
+} tree_node;
+
+static gint compare_tree_nodes (gconstpointer a, gconstpointer b) {/*{{{*/
+    const tree_node *na = a, *nb = b;
+    if (na->top != nb->top) {
+        return na->top < nb->top ? -1 : 1;
+    }
+    return na->seq < nb->seq ? -1 : na->seq > nb->seq;
+}/*}}}*/
+
+static Window *find_clients_by_wm_state (Display *disp, /*{{{*/
+        unsigned long *size) {
+    /* The client windows are the ones with WM_STATE, as in
+     * XmuClientWindow(), searched below all the top-level windows at
+     * once, one level of the tree after the other. The WM_STATE and
+     * QueryTree requests of a whole level go out in one burst through
+     * XCB and their replies are collected afterwards, so each level
+     * costs one round trip. Without a window manager no window has
+     * WM_STATE, then the mapped top-level windows which aren't
+     * override-redirect are the clients. The result is in stacking
+     * order, bottom to top, with its size in bytes like get_property(). */
+    xcb_connection_t *conn = XGetXCBConnection(disp);
+    Window root = DefaultRootWindow(disp);
+    Atom xa_wm_state = XInternAtom(disp, "WM_STATE", False);
+    GArray *level = g_array_new(FALSE, FALSE, sizeof(tree_node));
+    GArray *found = g_array_new(FALSE, FALSE, sizeof(tree_node));
+    Window *client_list = NULL;
+    xcb_query_tree_reply_t *tree;
+    xcb_window_t *children;
+    unsigned int depth = 0;
+    int i, j, n;
+
+    if (! (tree = xcb_query_tree_reply(conn, xcb_query_tree(conn, root), NULL))) {
+        g_array_free(level, TRUE);
+        g_array_free(found, TRUE);
+        return NULL;
+    }
+    children = xcb_query_tree_children(tree);
+    for (i = 0; i < xcb_query_tree_children_length(tree); i++) {
+        tree_node node = { children[i], i, 0 };
+        g_array_append_val(level, node);
+    }
+    free(tree);
+
+    while (level->len) {
+        GArray *next = g_array_new(FALSE, FALSE, sizeof(tree_node));
+        xcb_get_property_cookie_t *state_cookies =
+            g_new(xcb_get_property_cookie_t, level->len);
+        xcb_query_tree_cookie_t *tree_cookies =
+            g_new(xcb_query_tree_cookie_t, level->len);
+
+        /* the whole level at once */
+        for (i = 0; i < level->len; i++) {
+            Window win = g_array_index(level, tree_node, i).win;
+            state_cookies[i] = xcb_get_property(conn, 0, win, xa_wm_state,
+                    XCB_GET_PROPERTY_TYPE_ANY, 0, 0);
+            tree_cookies[i] = xcb_query_tree(conn, win);
+        }
+
+        for (i = 0; i < level->len; i++) {
+            tree_node *node = &g_array_index(level, tree_node, i);
+            xcb_get_property_reply_t *state;
+            xcb_generic_error_t *err = NULL;
+            gboolean is_client;
+
+            /* errors mean that the window was destroyed meanwhile */
+            state = xcb_get_property_reply(conn, state_cookies[i], &err);
+            is_client = state && state->type != XCB_NONE;
+            free(state);
+            free(err);
+            err = NULL;
+
+            tree = xcb_query_tree_reply(conn, tree_cookies[i], &err);
+            free(err);
+            if (is_client) {
+                node->seq = found->len;
+                g_array_append_val(found, *node);
+            }
+            else if (tree) {
+                children = xcb_query_tree_children(tree);
+                n = xcb_query_tree_children_length(tree);
+                for (j = 0; j < n; j++) {
+                    tree_node child = { children[j], node->top, 0 };
+                    g_array_append_val(next, child);
+                }
+            }
+            free(tree);
+        }
+        g_free(state_cookies);
+        g_free(tree_cookies);
+        g_array_free(level, TRUE);
+        level = next;
+        depth++;
+    }
+    g_array_free(level, TRUE);
+    p_verbose("Found %u client windows with WM_STATE, %u levels deep.\n",
+            found->len, depth);
+
+    /* top-level windows without a window manager */
+    if (found->len == 0 && (tree = xcb_query_tree_reply(conn,
+                    xcb_query_tree(conn, root), NULL))) {
+        xcb_get_window_attributes_cookie_t *cookies;
+
+        children = xcb_query_tree_children(tree);
+        n = xcb_query_tree_children_length(tree);
+        cookies = g_new(xcb_get_window_attributes_cookie_t, n + 1);
+        for (i = 0; i < n; i++) {
+            cookies[i] = xcb_get_window_attributes(conn, children[i]);
+        }
+        for (i = 0; i < n; i++) {
+            xcb_generic_error_t *err = NULL;
+            xcb_get_window_attributes_reply_t *attr =
+                xcb_get_window_attributes_reply(conn, cookies[i], &err);
+            tree_node node = { children[i], i, i };
+
+            if (attr && attr->map_state == XCB_MAP_STATE_VIEWABLE &&
+                    ! attr->override_redirect) {
+                g_array_append_val(found, node);
+            }
+            free(attr);
+            free(err);
+        }
+        g_free(cookies);
+        free(tree);
+    }
+
+    /* back to stacking order, a level holds the windows below
+     * all the top-levels */
+    if (found->len) {
+        g_array_sort(found, compare_tree_nodes);
+        client_list = g_new(Window, found->len);
+        for (i = 0; i < found->len; i++) {
+            client_list[i] = g_array_index(found, tree_node, i).win;
+        }
+        *size = found->len * sizeof(Window);
+    }
+
+    g_array_free(found, TRUE);
+    return client_list;
+}/*}}}*/
+
 static Window *get_client_list (Display *disp, unsigned long *size) {/*{{{*/
     Window *client_list = NULL;
     char * msg = NULL;
@@ -1372,39 +7109,268 @@ static Window *get_client_list (Display *disp, unsigned long *size) {/*{{{*/
                 XA_CARDINAL, "_WIN_CLIENT_LIST", size);
     }
 
+    /* no EWMH or GNOME window manager, or it's restarting */
+    if (!client_list) {
+        p_verbose("Cannot get client list properties. (%s)\n"
+                "Looking for windows with WM_STATE.\n", msg);
+        client_list = find_clients_by_wm_state(disp, size);
+    }
+
     if (!client_list)
         fprintf(stderr, "Cannot get client list properties.\n(%s)\n", msg);
 
     return client_list;
 }/*}}}*/
 
+#define PROC_THREADS 8      /* concurrent readers of /proc */
+
+/* what -l --proc shows about the process of a window */
+typedef struct {
+    unsigned long pid;
+    gboolean ok;
+    double cpu;             /* user + system time in seconds */
+    unsigned long rss;      /* resident set size in KiB */
+    gchar *cmdline;
+} proc_info;
+
+static void proc_info_free (gpointer data) {/*{{{*/
+    proc_info *info = data;
+    g_free(info->cmdline);
+    g_free(info);
+}/*}}}*/
+
+static void read_proc_info (gpointer data, gpointer user_data) {/*{{{*/
+    /* runs in the thread pool, each info is filled by one thread only */
+    proc_info *info = data;
+    gchar path[64];
+    gchar *contents, *p;
+    gsize len, i;
+    unsigned long utime, stime, pages;
+
+    g_snprintf(path, sizeof(path), "/proc/%lu/stat", info->pid);
+    if (! g_file_get_contents(path, &contents, NULL, NULL)) {
+        return;
+    }
+    /* the command in parentheses may contain anything,
+     * utime and stime are the 12th and 13th fields after it */
+    p = strrchr(contents, ')');
+    if (! p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+            &utime, &stime) != 2) {
+        g_free(contents);
+        return;
+    }
+    g_free(contents);
+    info->cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+
+    g_snprintf(path, sizeof(path), "/proc/%lu/statm", info->pid);
+    if (g_file_get_contents(path, &contents, NULL, NULL)) {
+        if (sscanf(contents, "%*u %lu", &pages) == 1) {
+            info->rss = pages * (sysconf(_SC_PAGESIZE) / 1024);
+        }
+        g_free(contents);
+    }
+
+    g_snprintf(path, sizeof(path), "/proc/%lu/cmdline", info->pid);
+    if (g_file_get_contents(path, &contents, &len, NULL)) {
+        /* the arguments are separated by NULs */
+        while (len && contents[len - 1] == '\0') {
+            len--;
+        }
+        for (i = 0; i < len; i++) {
+            if (contents[i] == '\0' || contents[i] == '\t' || contents[i] == '\n') {
+                contents[i] = ' ';
+            }
+        }
+        contents[len] = '\0';
+        info->cmdline = contents;
+    }
+    info->ok = TRUE;
+}/*}}}*/
+
+static GHashTable *get_proc_infos (const unsigned long *pids, int n) {/*{{{*/
+    /* pid -> proc_info for the distinct non-zero pids, read concurrently */
+    GHashTable *infos = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+            NULL, proc_info_free);
+    GThreadPool *pool = NULL;
+    int i;
+
+    for (i = 0; i < n; i++) {
+        proc_info *info;
+
+        if (! pids[i] || g_hash_table_lookup(infos, GSIZE_TO_POINTER(pids[i]))) {
+            continue;
+        }
+        info = g_new0(proc_info, 1);
+        info->pid = pids[i];
+        g_hash_table_insert(infos, GSIZE_TO_POINTER(pids[i]), info);
+
+        if (! pool) {
+            pool = g_thread_pool_new(read_proc_info, NULL, PROC_THREADS,
+                    FALSE, NULL);
+        }
+        if (! pool || ! g_thread_pool_push(pool, info, NULL)) {
+            read_proc_info(info, NULL);
+        }
+    }
+
+    if (pool) {
+        /* wait for all of them */
+        g_thread_pool_free(pool, FALSE, TRUE);
+    }
+    return infos;
+}/*}}}*/
+
+static gboolean host_names_match (const gchar *a, const gchar *b) {/*{{{*/
+    /* "host" and "host.example.org" are the same machine, so only the
+     * names up to the first dot are compared */
+    gsize a_len = strcspn(a, ".");
+
+    return a_len == strcspn(b, ".") && g_ascii_strncasecmp(a, b, a_len) == 0;
+}/*}}}*/
+
+static gboolean is_local_machine (const gchar *client_machine) {/*{{{*/
+    /* WM_CLIENT_MACHINE is whatever the client found, it's checked
+     * against the name glib reports and the one from gethostname() */
+    char host[256];
+
+    if (host_names_match(client_machine, g_get_host_name())) {
+        return TRUE;
+    }
+    if (gethostname(host, sizeof(host)) == 0) {
+        host[sizeof(host) - 1] = '\0';
+        return host_names_match(client_machine, host);
+    }
+    return FALSE;
+}/*}}}*/
+
 static int list_windows (Display *disp) {/*{{{*/
     Window *client_list;
     unsigned long client_list_size;
-    int i;
+    unsigned long n_clients;
+    unsigned long *states = NULL;
+    unsigned long *pids = NULL;
+    unsigned long *local_pids = NULL;
+    GHashTable *procs = NULL;
+    int *depths = NULL;
+    int i, j;
     int max_client_machine_len = 0;
+    int max_state_len = 0;
 
     if ((client_list = get_client_list(disp, &client_list_size)) == NULL) {
         return EXIT_FAILURE;
     }
+    n_clients = client_list_size / sizeof(Window);
+
+    /* _NET_WM_STATE comes first, so that the windows which don't pass
+     * the --state filter are dropped before anything else is fetched;
+     * the requests for all the windows go out in one burst */
+    if (options.show_state || options.filter_state) {
+        xcb_get_property_cookie_t *cookies =
+            g_new(xcb_get_property_cookie_t, n_clients + 1);
+
+        init_wm_state_atoms(disp);
+        states = g_new0(unsigned long, n_clients);
+        for (i = 0; i < n_clients; i++) {
+            cookies[i] = get_property_request(disp, client_list[i],
+                    XA_ATOM, "_NET_WM_STATE");
+        }
+        for (i = 0, j = 0; i < n_clients; i++) {
+            unsigned long size = 0;
+            unsigned long state;
+            gboolean vanished;
+            Atom *atoms = (Atom *)get_property_reply(disp, cookies[i],
+                    XA_ATOM, &size, &vanished);
+
+            /* a missing _NET_WM_STATE means no state is set */
+            state = state_from_atoms(atoms, atoms ? size : 0);
+            g_free(atoms);
+            if (vanished || ! state_passes_filter(state)) {
+                continue;
+            }
+            client_list[j] = client_list[i];
+            states[j] = state;
+            j++;
+        }
+        n_clients = j;
+        g_free(cookies);
+    }
 
-    /* find the longest client_machine name */
-    for (i = 0; i < client_list_size / sizeof(Window); i++) {
+    /* --tree: parents before their children, which are indented */
+    if (options.tree) {
+        int *parents = g_new(int, n_clients);
+        int *order = g_new(int, n_clients);
+        Window *ordered = g_new(Window, n_clients);
+        int count = 0;
+
+        depths = g_new(int, n_clients);
+        get_client_parents(disp, client_list, n_clients, TRUE, parents);
+        for (i = 0; i < n_clients; i++) {
+            if (parents[i] < 0) {
+                tree_order(parents, n_clients, i, 0, order, depths, &count);
+            }
+        }
+        for (i = 0; i < n_clients; i++) {
+            ordered[i] = client_list[order[i]];
+        }
+        memcpy(client_list, ordered, n_clients * sizeof(Window));
+        if (states) {
+            unsigned long *ordered_states = g_new(unsigned long, n_clients);
+            for (i = 0; i < n_clients; i++) {
+                ordered_states[i] = states[order[i]];
+            }
+            g_free(states);
+            states = ordered_states;
+        }
+        g_free(ordered);
+        g_free(order);
+        g_free(parents);
+    }
+
+    /* find the longest client_machine name, the PIDs are fetched on
+     * the way for the PID column and, for --proc, the local clients */
+    if (options.show_pid || options.show_proc) {
+        pids = g_new0(unsigned long, n_clients);
+    }
+    if (options.show_proc) {
+        local_pids = g_new0(unsigned long, n_clients);
+    }
+    for (i = 0; i < n_clients; i++) {
         gchar *client_machine;
         if ((client_machine = get_property(disp, client_list[i],
                 XA_STRING, "WM_CLIENT_MACHINE", NULL))) {
             max_client_machine_len = strlen(client_machine);
         }
+        if (pids) {
+            unsigned long *pid = (unsigned long *)get_property(disp,
+                    client_list[i], XA_CARDINAL, "_NET_WM_PID", NULL);
+            pids[i] = pid ? *pid : 0;
+            g_free(pid);
+        }
+        if (local_pids && (! client_machine ||
+                    is_local_machine(client_machine))) {
+            local_pids[i] = pids[i];
+        }
         g_free(client_machine);
     }
+    if (local_pids) {
+        procs = get_proc_infos(local_pids, n_clients);
+    }
+
+    /* find the longest state string */
+    for (i = 0; options.show_state && i < n_clients; i++) {
+        gchar *state_str = wm_state_str(states[i]);
+        if (strlen(state_str) > max_state_len) {
+            max_state_len = strlen(state_str);
+        }
+        g_free(state_str);
+    }
 
     /* print the list */
-    for (i = 0; i < client_list_size / sizeof(Window); i++) {
-        gchar *title_utf8 = get_window_title(disp, client_list[i]); /* UTF8 */
-        gchar *title_out = get_output_str(title_utf8, TRUE);
+    for (i = 0; i < n_clients; i++) {
+        unsigned long serial = NextRequest(disp);
+        gchar *title_out = take_output_str(get_window_title(disp, client_list[i]), TRUE);
         gchar *client_machine;
         gchar *class_out = get_window_class(disp, client_list[i]); /* UTF8 */
-        unsigned long *pid;
         unsigned long *desktop;
         int x, y, junkx, junky;
         unsigned int wwidth, wheight, bw, depth;
@@ -1421,71 +7387,123 @@ static int list_windows (Display *disp) {/*{{{*/
         client_machine = get_property(disp, client_list[i],
                 XA_STRING, "WM_CLIENT_MACHINE", NULL);
 
-        /* pid */
-        pid = (unsigned long *)get_property(disp, client_list[i],
-                XA_CARDINAL, "_NET_WM_PID", NULL);
-
 	    /* geometry */
         XGetGeometry (disp, client_list[i], &junkroot, &junkx, &junky,
                           &wwidth, &wheight, &bw, &depth);
         XTranslateCoordinates (disp, client_list[i], junkroot, junkx, junky,
                                &x, &y, &junkroot);
 
-        /* special desktop ID -1 means "all desktops", so we
-           have to convert the desktop value to signed long */
-        printf("0x%.8lx %2ld", client_list[i],
-                desktop ? (signed long)*desktop : 0);
-        if (options.show_pid) {
-           printf(" %-6lu", pid ? *pid : 0);
-        }
-        if (options.show_geometry) {
-           printf(" %-4d %-4d %-4d %-4d", x, y, wwidth, wheight);
-        }
-		if (options.show_class) {
-		   printf(" %-20s ", class_out ? class_out : "N/A");
-		}
-
-        printf(" %*s %s\n",
-              max_client_machine_len,
-              client_machine ? client_machine : "N/A",
-              title_out ? title_out : "N/A"
-		);
-        g_free(title_utf8);
+        /* the window may have been destroyed after the client list
+         * was read, in which case some of the above requests failed */
+        if (window_vanished(client_list[i], serial)) {
+            p_verbose("Skipping window 0x%.8lx, it doesn't exist anymore.\n",
+                    client_list[i]);
+        }
+        else {
+            /* special desktop ID -1 means "all desktops", so we
+               have to convert the desktop value to signed long */
+            printf("0x%.8lx %2ld", client_list[i],
+                    desktop ? (signed long)*desktop : 0);
+            if (options.show_pid) {
+               printf(" %-6lu", pids[i]);
+            }
+            if (procs) {
+                /* CPU seconds and RSS in KiB after the PID column */
+                proc_info *info = g_hash_table_lookup(procs,
+                        GSIZE_TO_POINTER(local_pids[i]));
+                if (info && info->ok) {
+                    printf(" %9.2f %8lu", info->cpu, info->rss);
+                }
+                else {
+                    printf(" %9s %8s", "N/A", "N/A");
+                }
+            }
+            if (options.show_geometry) {
+               printf(" %-4d %-4d %-4d %-4d", x, y, wwidth, wheight);
+            }
+            if (options.show_monitor) {
+                int monitor = window_monitor(disp, x, y, wwidth, wheight);
+                if (monitor >= 0) {
+                    printf(" m%-2d", monitor);
+                }
+                else {
+                    printf(" %-3s", "-");
+                }
+            }
+            if (options.show_class) {
+               printf(" %-20s ", class_out ? class_out : "N/A");
+            }
+            if (options.show_state) {
+                gchar *state_str = wm_state_str(states[i]);
+                printf(" %-*s", max_state_len, state_str);
+                g_free(state_str);
+            }
+
+            printf(" %*s %*s%s",
+                  max_client_machine_len,
+                  client_machine ? client_machine : "N/A",
+                  depths ? depths[i] * 2 : 0, "",
+                  title_out ? title_out : "N/A"
+            );
+            if (procs) {
+                /* the command line follows the title after a tab */
+                proc_info *info = g_hash_table_lookup(procs,
+                        GSIZE_TO_POINTER(local_pids[i]));
+                printf("\t%s", info && info->cmdline ? info->cmdline : "N/A");
+            }
+            putchar('\n');
+        }
         g_free(title_out);
         g_free(desktop);
         g_free(client_machine);
         g_free(class_out);
-        g_free(pid);
     }
     g_free(client_list);
+    g_free(states);
+    g_free(pids);
+    g_free(local_pids);
+    g_free(depths);
+    if (procs) {
+        g_hash_table_destroy(procs);
+    }
 
     return EXIT_SUCCESS;
 }/*}}}*/
 
 static gchar *get_window_class (Display *disp, Window win) {/*{{{*/
-    gchar *class_utf8;
     gchar *wm_class;
     unsigned long size;
 
     wm_class = get_property(disp, win, XA_STRING, "WM_CLASS", &size);
+    return class_from_property(wm_class, size);
+}/*}}}*/
+
+static gchar *class_from_property (gchar *wm_class, /*{{{*/
+        unsigned long size) {
+    /* WM_CLASS as "instance.class" in UTF-8, wm_class is taken over */
+    gchar *class_utf8;
+
     if (wm_class) {
         gchar *p_0 = strchr(wm_class, '\0');
         if (wm_class + size - 1 > p_0) {
             *(p_0) = '.';
         }
-        class_utf8 = g_locale_to_utf8(wm_class, -1, NULL, NULL, NULL);
+        if (needs_conversion(wm_class)) {
+            class_utf8 = convert_charset(wm_class, TRUE);
+            g_free(wm_class);
+        }
+        else {
+            class_utf8 = wm_class;
+        }
     }
     else {
         class_utf8 = NULL;
     }
 
-    g_free(wm_class);
-
     return class_utf8;
 }/*}}}*/
 
 static gchar *get_window_title (Display *disp, Window win) {/*{{{*/
-    gchar *title_utf8;
     gchar *wm_name;
     gchar *net_wm_name;
 
@@ -1493,21 +7511,30 @@ static gchar *get_window_title (Display *disp, Window win) {/*{{{*/
     net_wm_name = get_property(disp, win,
             XInternAtom(disp, "UTF8_STRING", False), "_NET_WM_NAME", NULL);
 
+    return title_from_names(wm_name, net_wm_name);
+}/*}}}*/
+
+static gchar *title_from_names (gchar *wm_name, /*{{{*/
+        gchar *net_wm_name) {
+    /* the title in UTF-8, both buffers are taken over */
+    gchar *title_utf8;
+
+    /* the property buffers are handed over as they are
+     * whenever no conversion is needed */
     if (net_wm_name) {
-        title_utf8 = g_strdup(net_wm_name);
+        title_utf8 = net_wm_name;
+        g_free(wm_name);
     }
     else {
-        if (wm_name) {
-            title_utf8 = g_locale_to_utf8(wm_name, -1, NULL, NULL, NULL);
+        if (wm_name && needs_conversion(wm_name)) {
+            title_utf8 = convert_charset(wm_name, TRUE);
+            g_free(wm_name);
         }
         else {
-            title_utf8 = NULL;
+            title_utf8 = wm_name;
         }
     }
 
-    g_free(wm_name);
-    g_free(net_wm_name);
-
     return title_utf8;
 }/*}}}*/
 
@@ -1569,6 +7596,66 @@ static gchar *get_property (Display *disp, Window win, /*{{{*/
     return ret;
 }/*}}}*/
 
+static xcb_get_property_cookie_t get_property_request (Display *disp, /*{{{*/
+        Window win, Atom xa_prop_type, gchar *prop_name) {
+    /* The first half of get_property(). The requests for many windows
+     * go out through XCB in one burst, get_property_reply() collects
+     * the replies afterwards, so the burst costs a single round trip. */
+    return xcb_get_property(XGetXCBConnection(disp), 0, win,
+            XInternAtom(disp, prop_name, False), xa_prop_type,
+            0, MAX_PROPERTY_VALUE_LEN / 4);
+}/*}}}*/
+
+static gchar *get_property_reply (Display *disp, /*{{{*/
+        xcb_get_property_cookie_t cookie, Atom xa_prop_type,
+        unsigned long *size, gboolean *vanished) {
+    /* the second half of get_property(), the same result; vanished
+     * tells whether the window was gone */
+    xcb_generic_error_t *err = NULL;
+    xcb_get_property_reply_t *reply;
+    gchar *ret = NULL;
+
+    reply = xcb_get_property_reply(XGetXCBConnection(disp), cookie, &err);
+    if (vanished) {
+        *vanished = err && err->error_code == BadWindow;
+    }
+    if (reply && reply->type == xa_prop_type) {
+        ret = property_reply_data(reply, size);
+    }
+    free(reply);
+    free(err);
+    return ret;
+}/*}}}*/
+
+static gchar *property_reply_data (xcb_get_property_reply_t *reply, /*{{{*/
+        unsigned long *size) {
+    /* the value in the layout of XGetWindowProperty(): format 32 items
+     * as sign extended longs, NUL terminated */
+    const void *value = xcb_get_property_value(reply);
+    unsigned long tmp_size = xcb_get_property_value_length(reply);
+    gchar *ret;
+
+    if (reply->format == 32) {
+        unsigned long i, n = tmp_size / 4;
+
+        tmp_size = n * sizeof(long);
+        ret = g_malloc(tmp_size + 1);
+        for (i = 0; i < n; i++) {
+            ((long *)ret)[i] = (gint32)((const guint32 *)value)[i];
+        }
+    }
+    else {
+        ret = g_malloc(tmp_size + 1);
+        memcpy(ret, value, tmp_size);
+    }
+    ret[tmp_size] = '\0';
+
+    if (size) {
+        *size = tmp_size;
+    }
+    return ret;
+}/*}}}*/
+
 static Window Select_Window(Display *dpy) {/*{{{*/
     /*
      * Routine to let user select a window using the mouse
@@ -1599,7 +7686,11 @@ static Window Select_Window(Display *dpy) {/*{{{*/
     while ((target_win == None) || (buttons != 0)) {
         /* allow one more event */
         XAllowEvents(dpy, SyncPointer, CurrentTime);
-        XWindowEvent(dpy, root, ButtonPressMask|ButtonReleaseMask, &event);
+        if (! next_window_event(dpy, root, ButtonPressMask|ButtonReleaseMask, &event)) {
+            XUngrabPointer(dpy, CurrentTime);
+            fputs("ERROR: No window was selected in time.\n", stderr);
+            return 0;
+        }
         switch (event.type) {
             case ButtonPress:
                 if (target_win == None) {
@@ -0,0 +1,226 @@
+/* license {{{ */
+/*
+
+match_test - checks the <WIN> substring matching of wmctrl
+
+Copyright (C) 2003
+
+This program is free software which I release under the GNU General Public
+License. You may redistribute and/or modify this program under the terms
+of that license as published by the Free Software Foundation; either
+version 2 of the License, or (at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+To get a copy of the GNU General Puplic License,  write to the
+Free Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+/* }}} */
+
+/* ascii_contains_nocase() and str_matches_pattern() are static, so
+ * main.c is compiled into this program with its main() renamed. */
+#define main wmctrl_main
+#include "main.c"
+#undef main
+
+#include <strings.h>
+
+#define CHECK_ROUNDS 200000
+#define BENCH_ROUNDS 20000
+#define BENCH_TITLES "match_titles.txt"
+
+static const char alphabet[] = "aAbBzZ@[`{ 0\x7f\xc3";
+
+static gboolean reference_contains (const gchar *h, gsize hlen, /*{{{*/
+        const gchar *n, gsize nlen) {
+    gsize i;
+
+    for (i = 0; i + nlen <= hlen; i++) {
+        if (g_ascii_strncasecmp(h + i, n, nlen) == 0) {
+            return TRUE;
+        }
+    }
+    return nlen == 0;
+}/*}}}*/
+
+static void random_string (GRand *rand, gchar *buf, gsize len) {/*{{{*/
+    /* the characters around 'A'..'Z' and 'a'..'z' and bytes >= 0x80 */
+    gsize i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = alphabet[g_rand_int_range(rand, 0, sizeof(alphabet) - 1)];
+    }
+    buf[len] = '\0';
+}/*}}}*/
+
+static int check_kernel (void) {/*{{{*/
+    /* ascii_contains_nocase() against a strncasecmp() reference */
+    GRand *rand = g_rand_new_with_seed(1);
+    gchar haystack[100], needle[10];
+    int i, failed = 0;
+
+    for (i = 0; i < CHECK_ROUNDS; i++) {
+        gsize hlen = g_rand_int_range(rand, 0, sizeof(haystack));
+        gsize nlen = g_rand_int_range(rand, 0, sizeof(needle));
+        gchar *lower;
+
+        random_string(rand, haystack, hlen);
+        random_string(rand, needle, nlen);
+        /* most random needles don't occur, plant some */
+        if (nlen <= hlen && g_rand_boolean(rand)) {
+            memcpy(needle, haystack + g_rand_int_range(rand, 0,
+                        hlen - nlen + 1), nlen);
+        }
+        lower = g_ascii_strdown(needle, nlen);
+
+        if (ascii_contains_nocase(haystack, hlen, lower, nlen) !=
+                reference_contains(haystack, hlen, lower, nlen)) {
+            fprintf(stderr, "FAIL: \"%s\" in \"%s\"\n", lower, haystack);
+            failed++;
+        }
+        g_free(lower);
+    }
+
+    g_rand_free(rand);
+    printf("ascii_contains_nocase: %d of %d checks failed\n",
+            failed, CHECK_ROUNDS);
+    return failed;
+}/*}}}*/
+
+static int check_ascii (void) {/*{{{*/
+    /* str_is_ascii() with a high byte at every position of buffers of
+     * every length up to a few words, each allocated to its length */
+    int len, pos, checks = 0, failed = 0;
+
+    for (len = 0; len <= 4 * (int)sizeof(gsize); len++) {
+        for (pos = -1; pos < len; pos++) {
+            gchar *buf = g_malloc(MAX(len, 1));
+
+            memset(buf, 'a', len);
+            if (pos >= 0) {
+                buf[pos] = '\xc3';
+            }
+            if (str_is_ascii(buf, len) != (pos < 0)) {
+                fprintf(stderr, "FAIL: length %d, high byte at %d\n",
+                        len, pos);
+                failed++;
+            }
+            checks++;
+            g_free(buf);
+        }
+    }
+
+    printf("str_is_ascii: %d of %d checks failed\n", failed, checks);
+    return failed;
+}/*}}}*/
+
+static int check_patterns (void) {/*{{{*/
+    /* the ASCII fast path and the casefolding path of
+     * str_matches_pattern() */
+    static const struct {
+        const char *pattern;
+        const char *title;
+        gboolean matches;
+    } cases[] = {
+        {"firefox", "Mozilla Firefox", TRUE},
+        {"FIREFOX", "Mozilla Firefox", TRUE},
+        {"fox", "Mozilla Firefox", TRUE},
+        {"chrome", "Mozilla Firefox", FALSE},
+        {"", "anything", TRUE},
+        {"k", "\xe2\x84\xaa", TRUE},            /* KELVIN SIGN */
+        {"stra\xc3\x9f" "e", "STRASSE", TRUE},  /* sharp s */
+        {"\xc3\xa9t\xc3\xa9", "\xc3\x89T\xc3\x89", TRUE},
+        {"[", "{", FALSE},
+    };
+    int i, failed = 0;
+
+    envir_utf8 = TRUE;
+    for (i = 0; i < G_N_ELEMENTS(cases); i++) {
+        match_pattern pattern;
+
+        match_pattern_init(&pattern, cases[i].pattern);
+        if (str_matches_pattern(cases[i].title, &pattern) != cases[i].matches) {
+            fprintf(stderr, "FAIL: \"%s\" in \"%s\"\n", cases[i].pattern,
+                    cases[i].title);
+            failed++;
+        }
+        match_pattern_clear(&pattern);
+    }
+
+    printf("str_matches_pattern: %d of %d checks failed\n",
+            failed, (int)G_N_ELEMENTS(cases));
+    return failed;
+}/*}}}*/
+
+static void benchmark (const char *path) {/*{{{*/
+    /* str_matches_pattern() against casefolding every title, the way
+     * the titles used to be matched, over the titles in path */
+    gchar *contents;
+    gchar **titles;
+    const gchar *needle = "terminal";
+    match_pattern pattern;
+    gint64 start, fast, slow;
+    int i, j, n, hits = 0;
+    GError *err = NULL;
+
+    if (! g_file_get_contents(path, &contents, NULL, &err)) {
+        fprintf(stderr, "Cannot read %s: %s\n", path, err->message);
+        g_error_free(err);
+        return;
+    }
+    titles = g_strsplit(g_strchomp(contents), "\n", 0);
+    n = g_strv_length(titles);
+    g_free(contents);
+    match_pattern_init(&pattern, needle);
+
+    start = g_get_monotonic_time();
+    for (j = 0; j < BENCH_ROUNDS; j++) {
+        for (i = 0; i < n; i++) {
+            hits += str_matches_pattern(titles[i], &pattern);
+        }
+    }
+    fast = g_get_monotonic_time() - start;
+
+    start = g_get_monotonic_time();
+    for (j = 0; j < BENCH_ROUNDS; j++) {
+        for (i = 0; i < n; i++) {
+            gchar *folded = g_utf8_casefold(titles[i], -1);
+            hits += strstr(folded, needle) != NULL;
+            g_free(folded);
+        }
+    }
+    slow = g_get_monotonic_time() - start;
+
+    printf("%d titles from %s\n", n, path);
+    printf("str_matches_pattern: %.1f ns per title\n",
+            fast * 1000.0 / ((double)n * BENCH_ROUNDS));
+    printf("g_utf8_casefold + strstr: %.1f ns per title (%d hits)\n",
+            slow * 1000.0 / ((double)n * BENCH_ROUNDS), hits);
+
+    match_pattern_clear(&pattern);
+    g_strfreev(titles);
+}/*}}}*/
+
+int main (int argc, char **argv) {/*{{{*/
+    int failed = check_kernel() + check_ascii() + check_patterns();
+
+    /* the benchmark only on request, "make check" runs the checks;
+     * the titles are read from the given file or the one in srcdir */
+    if (argc > 1 && strcmp(argv[1], "-b") == 0) {
+        if (argc > 2) {
+            benchmark(argv[2]);
+        }
+        else {
+            const gchar *srcdir = g_getenv("srcdir");
+            gchar *path = g_build_filename(srcdir ? srcdir : ".",
+                    BENCH_TITLES, NULL);
+            benchmark(path);
+            g_free(path);
+        }
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}/*}}}*/